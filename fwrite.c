@@ -1,32 +1,141 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-struct threeNum
-{
-   int n1, n2, n3;
-};
+#include "threenum.h"
+#include "record_file.h"
+#include "record_schema.h"
+#include "record_mmap.h"
+
+#define COMMIT_RECORDS 65536
 
-int main()
+/*
+ * Writes struct threeNum records to program.bin through the batched
+ * record writer, behind a record_file.h header with CRC32C checksums.
+ *
+ *	-n <records>	number of records, default 4
+ *	-b <kbytes>	writer buffer size, default 4 MB
+ *	-t <kbytes>	flush threshold, default the buffer size
+ *	-a		write from a background thread, double buffered
+ *	-d		O_DIRECT, keep the dump out of the page cache
+ *	-m		build the records in a mapping of the file, growing
+ *			it in preallocated extents, no writer at all
+ *	-c <records>	with -m, publish the record count in the header
+ *			every so many records, default 65536
+ *
+ * gcc fwrite.c -lpthread
+ */
+int main(int argc, char **argv)
 {
-   int n;
+   int n, c, count = 4, async = 0, direct = 0, mapped = 0;
+   int commit = 0;
+   size_t buf_size = 0, threshold = 0;
    struct threeNum num;
-   FILE *fptr;
+   struct record_file_writer w;
+   struct record_appender a;
+   struct threeNum *rec;
+
+   while ((c = getopt(argc, argv, "n:b:t:admc:")) != -1)
+      switch (c)
+      {
+      case 'n':
+         count = atoi(optarg);
+         break;
+      case 'b':
+         buf_size = (size_t)atol(optarg) * 1024;
+         break;
+      case 't':
+         threshold = (size_t)atol(optarg) * 1024;
+         break;
+      case 'a':
+         async = 1;
+         break;
+      case 'd':
+         direct = 1;
+         break;
+      case 'm':
+         mapped = 1;
+         break;
+      case 'c':
+         commit = atoi(optarg);
+         if (commit <= 0)
+            goto usage;
+         break;
+      default:
+         goto usage;
+      }
+
+   /* The mapping replaces the writer and all of its knobs */
+   if (mapped ? async || direct || buf_size || threshold : commit)
+   {
+usage:
+      fprintf(stderr, "Usage: %s [-n records] [-b buf_kbytes] [-t flush_kbytes] [-a] [-d]\n"
+                      "       %s -m [-n records] [-c commit_records]\n", argv[0], argv[0]);
+      exit(1);
+   }
+   if (!commit)
+      commit = COMMIT_RECORDS;
+
+   if (mapped)
+   {
+      if (record_appender_open(&a, "program.bin", sizeof(struct threeNum),
+                               THREENUM_SCHEMA, 0) < 0){
+         printf("Error! opening file");
+         exit(1);
+      }
+      for(n = 1; n <= count; ++n)
+      {
+         rec = record_appender_reserve(&a, 1);
+         if (!rec){
+            printf("Error! growing file");
+            exit(1);
+         }
+         threenum_fill(rec, n);
+         record_appender_advance(&a, 1);
+         // Readers of the file see the records up to here
+         if (n % commit == 0 && record_appender_commit(&a, 0) < 0){
+            printf("Error! committing records");
+            exit(1);
+         }
+      }
+      if (record_appender_close(&a) < 0){
+         printf("Error! writing file");
+         exit(1);
+      }
+      record_appender_stats(&a, stdout);
+      return 0;
+   }
 
-   if ((fptr = fopen("program.bin","wb")) == NULL){
+   if (threenum_file_open(&w, "program.bin", buf_size, threshold) < 0){
        printf("Error! opening file");
 
-       // Program exits if the file pointer returns NULL
+       // Program exits if the file can't be created
+       exit(1);
+   }
+   if (direct && record_writer_direct(&w.w) < 0){
+       printf("Error! enabling O_DIRECT");
+       exit(1);
+   }
+   if (async && record_writer_async(&w.w) < 0){
+       printf("Error! starting writer thread");
        exit(1);
    }
 
-   for(n = 1; n < 5; ++n)
+   for(n = 1; n <= count; ++n)
    {
-      num.n1 = n;
-      num.n2 = 5*n;
-      num.n3 = 5*n + 1;
-      fwrite(&num, sizeof(struct threeNum), 1, fptr); 
+      threenum_fill(&num, n);
+      if (threenum_file_append(&w, &num) < 0){
+         printf("Error! writing file");
+         exit(1);
+      }
+   }
+   if (record_file_close(&w) < 0){
+      printf("Error! writing file");
+      exit(1);
    }
-   fclose(fptr); 
-  
+
+   record_writer_stats(&w.w, stdout);
+
    return 0;
 }
@@ -1,21 +1,55 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 
+#include "record_file.h"
+#include "record_bulk.h"
+
+/* filewb.bin holds one int record behind a record_file.h header */
+#define FILEWB_SCHEMA	"v:i32"
+
 int main() {
-	int buffer;
+	int buffer[2];
 	int store = 0x1234;
 	/* Creating a file and storing an int value */
-	FILE * stream;
-	int count;
+	struct record_file_writer w;
+	struct record_file_header hdr;
+	struct bulk_reader r;
+	size_t want = sizeof(buffer) / sizeof(buffer[0]);
+	ssize_t count;
+
+	if (record_file_open(&w, "filewb.bin", sizeof(int), FILEWB_SCHEMA,
+			     0, 0) < 0 || record_file_append(&w, &store) < 0 ||
+	    record_file_close(&w) < 0) {
+		perror("filewb.bin");
+		return(1);
+	}
 
-	stream = fopen("filewb.bin", "wb");
-	fwrite(&store, sizeof(int), 1, stream);
-	fclose(stream);
+	// Reading value from file, as many ints as fit buffer
+	if (bulk_open(&r, "filewb.bin", 0) < 0) {
+		perror("filewb.bin");
+		return(1);
+	}
 
-	// Reading value from file
-	stream = fopen("filewb.bin", "rb");
-	count = fread(&buffer, sizeof(char), 8, stream);
+	/* Check the header, files from before it are raw ints */
+	if (bulk_read(&r, &hdr, sizeof(hdr), 1) == 1 &&
+	    !memcmp(hdr.magic, RECORD_FILE_MAGIC, sizeof(RECORD_FILE_MAGIC))) {
+		if (record_file_check_header(&hdr, sizeof(int),
+					     FILEWB_SCHEMA)) {
+			perror("filewb.bin");
+			bulk_close(&r);
+			return(1);
+		}
+		/* The block CRCs follow the records */
+		if (hdr.count < want)
+			want = hdr.count;
+	} else {
+		bulk_seek(&r, 0);
+	}
+	count = bulk_read_int(&r, buffer, want);
 
-	printf("count: %d\n",count);
-	fclose(stream);
+	printf("count: %zd\n",count);
+	if (count > 0)
+		printf("value: 0x%x\n", buffer[0]);
+	bulk_close(&r);
 	return(0);
 }
@@ -0,0 +1,1049 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "threenum.h"
+
+/*
+ * Record I/O microbenchmark.
+ *
+ * Writes the same records with every strategy the record tools use or
+ * could use, then reads them back with every read strategy, and reports
+ * per strategy:
+ *
+ *	MB/s		records written or read / wall time, syncs included
+ *	p50, p99	latency of one flush: the fwrite() that writes out
+ *			the -b buffer, a write(), writev(), mapped chunk or
+ *			io_uring completion, plus its fdatasync() with
+ *			-s flush; for reads, the fread() that refills the
+ *			buffer, a read() or pread(), mapped chunk or
+ *			io_uring completion
+ *	CPU s/GB	user + system time of the process per GB
+ *
+ * Write strategies (-m, comma separated, default all):
+ *	fwrite		stdio, one fwrite() per record, as fwrite.c did
+ *	write		records batched in a buffer, one write() per buffer
+ *	writev		records left where they are, IOV_MAX per writev()
+ *	mmap		file sized up front, records generated into the map
+ *	direct		write() with O_DIRECT from an aligned buffer
+ *	uring		io_uring writes, -q buffers in flight
+ *
+ * Read strategies, of a file written once and dropped from the page
+ * cache before every run, so reads come from the disk:
+ *	fread		stdio, one fread() per record
+ *	read		one read() per buffer
+ *	pread		one pread() per buffer, at explicit offsets
+ *	mmap		the whole file mapped, walked a buffer at a time
+ *	direct		read() with O_DIRECT into an aligned buffer
+ *	uring		io_uring reads, -q buffers in flight
+ *
+ * Reads check the records they got against the ones written.
+ *
+ *	-d <dirs>	write, read or both (default)
+ *	-r <bytes>	record size, default 12 (struct threeNum)
+ *	-n <records>	records per run, default 4M
+ *	-b <kbytes>	buffer (flush) size, default 1024
+ *	-s <policy>	none, end (one fdatasync) or flush (every flush)
+ *	-q <depth>	io_uring queue depth, default 4
+ *	-i <runs>	runs per strategy, best throughput reported
+ *	-f <file>	scratch file, default record_bench.tmp
+ *
+ * gcc -O2 record_bench.c -o record_bench
+ */
+#define BENCH_ALIGN	4096
+
+enum sync_policy {
+	SYNC_NONE,
+	SYNC_END,
+	SYNC_FLUSH,
+};
+
+struct bench {
+	const char *path;
+	size_t rec_size;
+	uint64_t records;
+	size_t buf_size;	/* Multiple of BENCH_ALIGN and rec_size */
+	enum sync_policy sync;
+	unsigned int depth;
+
+	/* Per run */
+	uint64_t *lat;		/* Flush latencies, ns */
+	size_t nlat, lat_alloc;
+	int fd;
+	uint64_t sum;		/* Of the records read, see consume() */
+	uint64_t expect;	/* Of the records written */
+};
+
+struct result {
+	double mbs;
+	double p50_us, p99_us;
+	double cpu_per_gb;
+	size_t flushes;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void lat_add(struct bench *b, uint64_t ns)
+{
+	uint64_t *tmp;
+
+	if (b->nlat == b->lat_alloc) {
+		b->lat_alloc = b->lat_alloc ? 2 * b->lat_alloc : 4096;
+		tmp = realloc(b->lat, b->lat_alloc * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		b->lat = tmp;
+	}
+	b->lat[b->nlat++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Record i, struct threeNum padded or cut to the record size */
+static void gen_record(char *p, uint64_t i, size_t rec_size)
+{
+	struct threeNum num;
+
+	threenum_fill(&num, i + 1);
+	if (rec_size <= sizeof(num)) {
+		memcpy(p, &num, rec_size);
+	} else {
+		memcpy(p, &num, sizeof(num));
+		memset(p + sizeof(num), 0, rec_size - sizeof(num));
+	}
+}
+
+/* Records from first into buf, returns how many fitted */
+static size_t gen_batch(char *buf, size_t len, uint64_t first,
+			const struct bench *b)
+{
+	size_t n = len / b->rec_size, i;
+
+	if (n > b->records - first)
+		n = b->records - first;
+	for (i = 0; i < n; i++)
+		gen_record(buf + i * b->rec_size, first + i, b->rec_size);
+
+	return n;
+}
+
+/* Fold n records read into b->sum, so reads touch and check them */
+static void consume(struct bench *b, const char *p, size_t n)
+{
+	size_t i, len = b->rec_size < sizeof(uint64_t) ? b->rec_size :
+							 sizeof(uint64_t);
+	uint64_t v;
+
+	for (i = 0; i < n; i++) {
+		v = 0;
+		memcpy(&v, p + i * b->rec_size, len);
+		b->sum += v;
+	}
+}
+
+static int write_full(int fd, const char *p, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int flush_sync(struct bench *b)
+{
+	return b->sync == SYNC_FLUSH ? fdatasync(b->fd) : 0;
+}
+
+static int bench_fwrite(struct bench *b)
+{
+	char rec[BENCH_ALIGN], *buf;
+	uint64_t i, t;
+	int cross;
+	FILE *f;
+
+	/* The -b buffer is stdio's; glibc ignores the size without one */
+	buf = malloc(b->buf_size);
+	if (!buf)
+		return -1;
+	f = fdopen(b->fd, "w");
+	if (!f || setvbuf(f, buf, _IOFBF, b->buf_size))
+		goto err;
+
+	for (i = 0; i < b->records; i++) {
+		gen_record(rec, i, b->rec_size);
+		/*
+		 * A "flush" of stdio is the call that writes its buffer out:
+		 * the one filling it with -s flush, which fflush()es, else
+		 * the one that doesn't fit in what's left of it.
+		 */
+		if (b->sync == SYNC_FLUSH)
+			cross = (i + 1) * b->rec_size % b->buf_size <
+				b->rec_size;
+		else
+			cross = i && (i * b->rec_size - 1) / b->buf_size !=
+				(i * b->rec_size + b->rec_size - 1) /
+				b->buf_size;
+		t = now_ns();
+		if (fwrite(rec, b->rec_size, 1, f) != 1)
+			goto err;
+		if (b->sync == SYNC_FLUSH && cross &&
+		    (fflush(f) || flush_sync(b)))
+			goto err;
+		if (cross)
+			lat_add(b, now_ns() - t);
+	}
+
+	if (fflush(f))
+		goto err;
+	/* The fd is closed by the caller */
+	b->fd = dup(b->fd);
+	fclose(f);
+	free(buf);
+
+	return b->fd < 0 ? -1 : 0;
+
+err:
+	if (f) {
+		b->fd = dup(b->fd);
+		fclose(f);
+	}
+	free(buf);
+	return -1;
+}
+
+static int bench_write(struct bench *b)
+{
+	char *buf = aligned_alloc(BENCH_ALIGN, b->buf_size);
+	uint64_t i = 0, t;
+	size_t n;
+
+	if (!buf)
+		return -1;
+
+	while (i < b->records) {
+		n = gen_batch(buf, b->buf_size, i, b);
+		t = now_ns();
+		if (write_full(b->fd, buf, n * b->rec_size) || flush_sync(b)) {
+			free(buf);
+			return -1;
+		}
+		lat_add(b, now_ns() - t);
+		i += n;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int bench_writev(struct bench *b)
+{
+	struct iovec iov[IOV_MAX];
+	uint64_t i = 0, t;
+	size_t n, k, per = b->buf_size / b->rec_size;
+	char *recs;
+	ssize_t r;
+	int cnt, done, ret = -1;
+
+	if (per > IOV_MAX)
+		per = IOV_MAX;
+
+	/* Records produced in place, e.g. in an array of structs */
+	recs = malloc(per * b->rec_size);
+	if (!recs)
+		return -1;
+
+	while (i < b->records) {
+		n = gen_batch(recs, per * b->rec_size, i, b);
+		for (k = 0; k < n; k++) {
+			iov[k].iov_base = recs + k * b->rec_size;
+			iov[k].iov_len = b->rec_size;
+		}
+
+		t = now_ns();
+		for (cnt = n, done = 0; cnt; ) {
+			r = writev(b->fd, iov + done, cnt);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				goto out;
+			while (cnt && (size_t)r >= iov[done].iov_len) {
+				r -= iov[done].iov_len;
+				done++;
+				cnt--;
+			}
+			if (cnt) {
+				iov[done].iov_base =
+					(char *)iov[done].iov_base + r;
+				iov[done].iov_len -= r;
+			}
+		}
+		if (flush_sync(b))
+			goto out;
+		lat_add(b, now_ns() - t);
+		i += n;
+	}
+	ret = 0;
+
+out:
+	free(recs);
+	return ret;
+}
+
+static int bench_mmap(struct bench *b)
+{
+	size_t len = b->records * b->rec_size, off = 0, chunk, n;
+	uint64_t i = 0, t;
+	char *map;
+
+	if (!len)
+		return 0;
+	if (ftruncate(b->fd, len))
+		return -1;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	/* Chunks of the buffer size stand in for flushes */
+	while (i < b->records) {
+		t = now_ns();
+		chunk = len - off < b->buf_size ? len - off : b->buf_size;
+		n = gen_batch(map + off, chunk, i, b);
+		if (b->sync == SYNC_FLUSH &&
+		    msync(map + off - off % BENCH_ALIGN,
+			  n * b->rec_size + off % BENCH_ALIGN, MS_SYNC)) {
+			munmap(map, len);
+			return -1;
+		}
+		lat_add(b, now_ns() - t);
+		off += n * b->rec_size;
+		i += n;
+	}
+
+	if (b->sync == SYNC_END && msync(map, len, MS_SYNC)) {
+		munmap(map, len);
+		return -1;
+	}
+	return munmap(map, len);
+}
+
+static int bench_direct(struct bench *b)
+{
+	char *buf = aligned_alloc(BENCH_ALIGN, b->buf_size);
+	size_t n, fill = 0, len, total = 0;
+	uint64_t i = 0, t;
+	int flags;
+
+	if (!buf)
+		return -1;
+	flags = fcntl(b->fd, F_GETFL);
+	if (flags < 0 || fcntl(b->fd, F_SETFL, flags | O_DIRECT)) {
+		free(buf);
+		return -1;
+	}
+
+	while (i < b->records) {
+		n = gen_batch(buf + fill, b->buf_size - fill, i, b);
+		fill += n * b->rec_size;
+		i += n;
+
+		/* Whole blocks only, the tail waits for the next batch */
+		len = i < b->records ? fill & ~(size_t)(BENCH_ALIGN - 1) :
+				       (fill + BENCH_ALIGN - 1) &
+				       ~(size_t)(BENCH_ALIGN - 1);
+		if (!len)
+			continue;
+		if (len > fill)
+			memset(buf + fill, 0, len - fill);
+
+		t = now_ns();
+		if (write_full(b->fd, buf, len) || flush_sync(b)) {
+			free(buf);
+			return -1;
+		}
+		lat_add(b, now_ns() - t);
+
+		total += len < fill ? len : fill;
+		memmove(buf, buf + len, fill > len ? fill - len : 0);
+		fill = fill > len ? fill - len : 0;
+	}
+
+	free(buf);
+	/* The last block was padded */
+	return ftruncate(b->fd, total);
+}
+
+/* Like write_full(), but stops at the end of the file; returns bytes read */
+static ssize_t read_full(int fd, char *p, size_t len, off_t off, int pos)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = pos ? pread(fd, p + done, len - done, off + done) :
+			  read(fd, p + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!r)
+			break;
+		done += r;
+	}
+
+	return done;
+}
+
+/* The file the read strategies read, synced so it can leave the cache */
+static int prepare_read(struct bench *b)
+{
+	char *buf = malloc(b->buf_size);
+	uint64_t i = 0;
+	size_t n;
+	int ret = -1, err;
+
+	if (!buf)
+		return -1;
+	b->fd = open(b->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (b->fd < 0) {
+		free(buf);
+		return -1;
+	}
+
+	b->sum = 0;
+	while (i < b->records) {
+		n = gen_batch(buf, b->buf_size, i, b);
+		if (write_full(b->fd, buf, n * b->rec_size))
+			goto out;
+		consume(b, buf, n);
+		i += n;
+	}
+	if (fdatasync(b->fd))
+		goto out;
+	b->expect = b->sum;
+	ret = 0;
+
+out:
+	err = errno;
+	close(b->fd);
+	free(buf);
+	errno = err;
+	return ret;
+}
+
+static int bench_fread(struct bench *b)
+{
+	char rec[BENCH_ALIGN], *buf;
+	uint64_t i, t;
+	int refill;
+	FILE *f;
+
+	buf = malloc(b->buf_size);
+	if (!buf)
+		return -1;
+	f = fdopen(b->fd, "r");
+	if (!f || setvbuf(f, buf, _IOFBF, b->buf_size))
+		goto err;
+
+	for (i = 0; i < b->records; i++) {
+		/* Whole records per buffer, so a refill starts a record */
+		refill = i * b->rec_size % b->buf_size == 0;
+		t = now_ns();
+		if (fread(rec, b->rec_size, 1, f) != 1) {
+			if (!ferror(f))
+				errno = EIO;
+			goto err;
+		}
+		if (refill)
+			lat_add(b, now_ns() - t);
+		consume(b, rec, 1);
+	}
+
+	/* The fd is closed by the caller */
+	b->fd = dup(b->fd);
+	fclose(f);
+	free(buf);
+
+	return b->fd < 0 ? -1 : 0;
+
+err:
+	if (f) {
+		b->fd = dup(b->fd);
+		fclose(f);
+	}
+	free(buf);
+	return -1;
+}
+
+/* One read() or, with pos, pread() per buffer */
+static int read_loop(struct bench *b, int pos)
+{
+	char *buf = aligned_alloc(BENCH_ALIGN, b->buf_size);
+	size_t len = b->records * b->rec_size, off = 0;
+	ssize_t n;
+	uint64_t t;
+
+	if (!buf)
+		return -1;
+
+	while (off < len) {
+		t = now_ns();
+		n = read_full(b->fd, buf, b->buf_size, off, pos);
+		if (n <= 0 || n % b->rec_size) {
+			if (n >= 0)
+				errno = EIO;
+			free(buf);
+			return -1;
+		}
+		lat_add(b, now_ns() - t);
+		consume(b, buf, n / b->rec_size);
+		off += n;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int bench_read(struct bench *b)
+{
+	return read_loop(b, 0);
+}
+
+static int bench_pread(struct bench *b)
+{
+	return read_loop(b, 1);
+}
+
+static int bench_mmap_read(struct bench *b)
+{
+	size_t len = b->records * b->rec_size, off, chunk;
+	uint64_t t;
+	char *map;
+
+	if (!len)
+		return 0;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, b->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, len, MADV_SEQUENTIAL);
+
+	/* Chunks of the buffer size stand in for reads */
+	for (off = 0; off < len; off += chunk) {
+		chunk = len - off < b->buf_size ? len - off : b->buf_size;
+		t = now_ns();
+		consume(b, map + off, chunk / b->rec_size);
+		lat_add(b, now_ns() - t);
+	}
+
+	return munmap(map, len);
+}
+
+static int bench_direct_read(struct bench *b)
+{
+	int flags = fcntl(b->fd, F_GETFL);
+
+	if (flags < 0 || fcntl(b->fd, F_SETFL, flags | O_DIRECT))
+		return -1;
+	/* The last block is short, which O_DIRECT reads allow at the end */
+	return read_loop(b, 0);
+}
+
+struct uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	struct io_uring_cqe *cqes;
+};
+
+/* Also undoes a uring_init() that got part of the way */
+static void uring_exit(struct uring *u)
+{
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring != u->sq_ring && u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_len);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_len);
+	close(u->fd);
+}
+
+static int uring_init(struct uring *u, unsigned depth)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(&p, 0, sizeof(p));
+	u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+	u->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto err;
+	u->cq_ring = u->sq_ring;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto err;
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err;
+
+	u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	err = errno;
+	uring_exit(u);
+	errno = err;
+	return -1;
+}
+
+/* Submits one IORING_OP_READ or IORING_OP_WRITE */
+static int uring_rw(struct uring *u, int op, int fd, void *buf, size_t len,
+		    off_t off, uint64_t tag, int dsync)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = tag;
+	if (dsync)
+		sqe->rw_flags = RWF_DSYNC;
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int uring_wait(struct uring *u, uint64_t *tag, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head = *u->cq_head;
+
+	while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		if (syscall(__NR_io_uring_enter, u->fd, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			return -1;
+
+	cqe = &u->cqes[head & *u->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* -q buffers in flight, written or, with read, read and checked */
+static int uring_loop(struct bench *b, int read)
+{
+	unsigned int depth = b->depth, nfree = 0, inflight = 0, k, *free_list;
+	uint64_t i = 0, tag, *start;
+	size_t *len, n;
+	char **buf;
+	off_t off = 0;
+	struct uring u;
+	int op = read ? IORING_OP_READ : IORING_OP_WRITE;
+	int res, ret = -1, err;
+
+	if (uring_init(&u, depth))
+		return -1;
+	buf = calloc(depth, sizeof(*buf));
+	len = calloc(depth, sizeof(*len));
+	start = calloc(depth, sizeof(*start));
+	free_list = calloc(depth, sizeof(*free_list));
+	if (!buf || !len || !start || !free_list)
+		goto out;
+	for (k = 0; k < depth; k++) {
+		buf[k] = aligned_alloc(BENCH_ALIGN, b->buf_size);
+		if (!buf[k])
+			goto out;
+		free_list[nfree++] = k;
+	}
+
+	/*
+	 * I/O completes in any order: each is tagged with its buffer,
+	 * which goes back on the free list when its completion is reaped.
+	 */
+	while (i < b->records || inflight) {
+		if (i < b->records && nfree) {
+			k = free_list[--nfree];
+			if (read) {
+				n = b->buf_size / b->rec_size;
+				if (n > b->records - i)
+					n = b->records - i;
+			} else {
+				n = gen_batch(buf[k], b->buf_size, i, b);
+			}
+			len[k] = n * b->rec_size;
+			start[k] = now_ns();
+			if (uring_rw(&u, op, b->fd, buf[k], len[k], off, k,
+				     !read && b->sync == SYNC_FLUSH)) {
+				free_list[nfree++] = k;
+				goto out;
+			}
+			inflight++;
+			off += len[k];
+			i += n;
+			continue;
+		}
+
+		if (uring_wait(&u, &tag, &res))
+			goto out;
+		inflight--;
+		if (tag >= depth) {
+			errno = EIO;
+			goto out;
+		}
+		if (res < 0 || (size_t)res != len[tag]) {
+			/* Short I/O doesn't happen inside a regular file */
+			errno = res < 0 ? -res : EIO;
+			goto out;
+		}
+		lat_add(b, now_ns() - start[tag]);
+		if (read)
+			consume(b, buf[tag], len[tag] / b->rec_size);
+		free_list[nfree++] = tag;
+	}
+	ret = 0;
+
+out:
+	/* The kernel may still be using the buffers of what's in flight */
+	err = errno;
+	while (inflight && !uring_wait(&u, &tag, &res))
+		inflight--;
+	for (k = 0; !inflight && buf && k < depth; k++)
+		free(buf[k]);
+	free(buf);
+	free(len);
+	free(start);
+	free(free_list);
+	uring_exit(&u);
+	errno = err;
+	return ret;
+}
+
+static int bench_uring(struct bench *b)
+{
+	return uring_loop(b, 0);
+}
+
+static int bench_uring_read(struct bench *b)
+{
+	return uring_loop(b, 1);
+}
+
+static const struct method {
+	const char *name;
+	int (*run)(struct bench *b);
+	int read;		/* Of the file prepare_read() wrote */
+} methods[] = {
+	{ "fwrite", bench_fwrite, 0 },
+	{ "write", bench_write, 0 },
+	{ "writev", bench_writev, 0 },
+	{ "mmap", bench_mmap, 0 },
+	{ "direct", bench_direct, 0 },
+	{ "uring", bench_uring, 0 },
+	{ "fread", bench_fread, 1 },
+	{ "read", bench_read, 1 },
+	{ "pread", bench_pread, 1 },
+	{ "mmap", bench_mmap_read, 1 },
+	{ "direct", bench_direct_read, 1 },
+	{ "uring", bench_uring_read, 1 },
+};
+
+#define NMETHODS	(sizeof(methods) / sizeof(methods[0]))
+
+/* name is one of the comma separated names in list */
+static int method_listed(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+		if (!strncmp(p, name, len) && (p[len] == ',' || !p[len]))
+			return 1;
+
+	return 0;
+}
+
+static int run(struct bench *b, const struct method *m, struct result *r)
+{
+	uint64_t t0, t1;
+	double c0, c1, gb;
+	struct stat st;
+	int err;
+
+	b->nlat = 0;
+	b->sum = 0;
+	if (m->read)
+		b->fd = open(b->path, O_RDONLY);
+	else
+		b->fd = open(b->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (b->fd < 0)
+		return -1;
+	/* Cold cache: the file is clean, so all of it goes */
+	if (m->read && (errno = posix_fadvise(b->fd, 0, 0,
+					      POSIX_FADV_DONTNEED)))
+		goto err;
+
+	c0 = cpu_secs();
+	t0 = now_ns();
+	if (m->run(b) || (!m->read && b->sync == SYNC_END && fdatasync(b->fd)))
+		goto err;
+	t1 = now_ns();
+	c1 = cpu_secs();
+
+	if (m->read && b->sum != b->expect) {
+		fprintf(stderr, "%s: records read back differ\n", m->name);
+		errno = EIO;
+		goto err;
+	}
+	if (!m->read && (fstat(b->fd, &st) ||
+	    (uint64_t)st.st_size != b->records * b->rec_size)) {
+		fprintf(stderr, "%s: wrote %lld bytes, expected %llu\n",
+			m->name, (long long)st.st_size,
+			(unsigned long long)(b->records * b->rec_size));
+		errno = EIO;
+		goto err;
+	}
+	close(b->fd);
+	if (!m->read)
+		unlink(b->path);
+
+	gb = b->records * b->rec_size / 1e9;
+	r->mbs = gb * 1e3 / ((t1 - t0) / 1e9);
+	r->cpu_per_gb = gb ? (c1 - c0) / gb : 0;
+	r->flushes = b->nlat;
+	r->p50_us = r->p99_us = 0;
+	if (b->nlat) {
+		qsort(b->lat, b->nlat, sizeof(*b->lat), cmp_u64);
+		/* Nearest rank */
+		r->p50_us = b->lat[(b->nlat + 1) / 2 - 1] / 1e3;
+		r->p99_us = b->lat[(b->nlat * 99 + 99) / 100 - 1] / 1e3;
+	}
+
+	return 0;
+
+err:
+	err = errno;
+	close(b->fd);
+	errno = err;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.path = "record_bench.tmp",
+		.rec_size = sizeof(struct threeNum),
+		.records = 4 << 20,
+		.buf_size = 1 << 20,
+		.sync = SYNC_NONE,
+		.depth = 4,
+	};
+	static const char *const sync_names[] = { "none", "end", "flush" };
+	static const char *const dir_names[] = { "write", "read", "both" };
+	const char *only = NULL;
+	struct result r, best;
+	size_t k, chunk;
+	int c, iter, runs = 1, dirs = 2, read, prepared = 0;
+
+	while ((c = getopt(argc, argv, "d:r:n:b:s:q:i:m:f:")) != -1)
+		switch (c) {
+		case 'd':
+			for (k = 0; k < 3 && strcmp(optarg, dir_names[k]); k++)
+				;
+			if (k == 3) {
+				fprintf(stderr, "-d write, read or both\n");
+				return 1;
+			}
+			dirs = k;
+			break;
+		case 'r':
+			b.rec_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.records = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			b.buf_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 's':
+			for (k = 0; k < 3 && strcmp(optarg, sync_names[k]); k++)
+				;
+			if (k == 3) {
+				fprintf(stderr, "-s none, end or flush\n");
+				return 1;
+			}
+			b.sync = k;
+			break;
+		case 'q':
+			b.depth = atoi(optarg);
+			break;
+		case 'i':
+			runs = atoi(optarg);
+			break;
+		case 'm':
+			only = optarg;
+			break;
+		case 'f':
+			b.path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d write|read|both] "
+				"[-r rec_size] [-n records] [-b buf_kbytes]\n"
+				"\t[-s none|end|flush] [-q depth] [-i runs] "
+				"[-m method,...] [-f file]\n", argv[0]);
+			return 1;
+		}
+
+	if (!b.rec_size || b.rec_size > BENCH_ALIGN || !b.depth || runs < 1) {
+		fprintf(stderr, "Invalid -r, -q or -i\n");
+		return 1;
+	}
+
+	/* Whole records per flush, and whole blocks for O_DIRECT */
+	chunk = b.rec_size * BENCH_ALIGN;
+	while (chunk % BENCH_ALIGN == 0 && chunk / 2 % b.rec_size == 0 &&
+	       chunk / 2 % BENCH_ALIGN == 0)
+		chunk /= 2;
+	b.buf_size = (b.buf_size + chunk - 1) / chunk * chunk;
+
+	printf("%llu records of %zu bytes (%.1f MB), %zu KB flushes, sync %s\n",
+	       (unsigned long long)b.records, b.rec_size,
+	       b.records * b.rec_size / 1e6, b.buf_size / 1024,
+	       sync_names[b.sync]);
+
+	/* Writes first, they leave the scratch file free for the reads' */
+	for (read = 0; read < 2; read++) {
+		if (dirs != 2 && dirs != read)
+			continue;
+		printf("\n%-8s %10s %10s %10s %10s %10s\n",
+		       read ? "read" : "write", "MB/s",
+		       read ? "reads" : "flushes", "p50 us", "p99 us",
+		       "CPU s/GB");
+
+		for (k = 0; k < NMETHODS; k++) {
+			if (methods[k].read != read ||
+			    (only && !method_listed(only, methods[k].name)))
+				continue;
+			if (read && !prepared) {
+				if (prepare_read(&b)) {
+					perror(b.path);
+					unlink(b.path);
+					free(b.lat);
+					return 1;
+				}
+				prepared = 1;
+			}
+
+			memset(&best, 0, sizeof(best));
+			for (iter = 0; iter < runs; iter++) {
+				if (run(&b, &methods[k], &r)) {
+					fprintf(stderr, "%s: %s\n",
+						methods[k].name,
+						strerror(errno));
+					if (!read)
+						unlink(b.path);
+					break;
+				}
+				if (r.mbs > best.mbs)
+					best = r;
+			}
+			if (iter < runs)
+				continue;
+
+			printf("%-8s %10.1f %10zu %10.1f %10.1f %10.3f\n",
+			       methods[k].name, best.mbs, best.flushes,
+			       best.p50_us, best.p99_us, best.cpu_per_gb);
+		}
+	}
+
+	if (prepared)
+		unlink(b.path);
+	free(b.lat);
+	return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef RECORD_BULK_H
+#define RECORD_BULK_H
+
+/*
+ * Typed bulk reads.
+ *
+ * Reads up to n elements of one type into a caller array in a single
+ * call, straight from the page cache: pread() copies into the caller's
+ * memory with no stdio buffer in between, and a mapped reader memcpy()s
+ * out of the mapping, or hands out a pointer into it with no copy at
+ * all. The element count, never a byte count, comes back, and only whole
+ * elements are consumed, so a torn element at the end of a file is
+ * neither returned nor skipped.
+ *
+ * Typed wrappers take the element size from the array type, so the
+ * buffer can't be overrun by asking for the wrong size:
+ *
+ *	int32_t v[256];
+ *	n = bulk_read_i32(&r, v, 256);
+ *
+ * BULK_DEFINE(name, type) adds wrappers for other types.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "threenum.h"
+
+struct bulk_reader {
+	int fd;
+	off_t off;		/* Next byte to read */
+	const char *map;	/* Whole file, NULL when using pread() */
+	size_t map_len;
+};
+
+/**
+ * bulk_open: open a file for bulk reads.
+ * @r: reader
+ * @path: file
+ * @use_mmap: map the file and copy out of (or point into) the mapping
+ */
+static inline int bulk_open(struct bulk_reader *r, const char *path,
+			    int use_mmap)
+{
+	struct stat st;
+	void *map;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = open(path, O_RDONLY);
+	if (r->fd < 0)
+		return -1;
+	if (!use_mmap)
+		return 0;
+
+	if (fstat(r->fd, &st)) {
+		close(r->fd);
+		return -1;
+	}
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->fd, 0);
+		if (map == MAP_FAILED) {
+			close(r->fd);
+			return -1;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		r->map = map;
+	}
+	r->map_len = st.st_size;
+
+	return 0;
+}
+
+static inline void bulk_close(struct bulk_reader *r)
+{
+	if (r->map)
+		munmap((void *)r->map, r->map_len);
+	close(r->fd);
+}
+
+/* Continue at byte off, e.g. past a file header */
+static inline void bulk_seek(struct bulk_reader *r, off_t off)
+{
+	r->off = off;
+}
+
+/**
+ * bulk_read: read up to n elements into dst.
+ * @r: reader
+ * @dst: room for n elements
+ * @size: element size
+ * @n: elements wanted
+ *
+ * Returns the number of whole elements read, 0 at the end of the file,
+ * or -1 with errno set if nothing could be read.
+ */
+static inline ssize_t bulk_read(struct bulk_reader *r, void *dst, size_t size,
+				size_t n)
+{
+	size_t want = n * size, got = 0, left;
+	ssize_t ret;
+
+	if (!size || !n)
+		return 0;
+
+	if (r->map) {
+		left = (size_t)r->off < r->map_len ? r->map_len - r->off : 0;
+		if (want > left - left % size)
+			want = left - left % size;
+		memcpy(dst, r->map + r->off, want);
+		r->off += want;
+		return want / size;
+	}
+
+	while (got < want) {
+		ret = pread(r->fd, (char *)dst + got, want - got, r->off + got);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (got < size)
+				return -1;
+			break;
+		}
+		if (!ret)
+			break;
+		got += ret;
+	}
+
+	/* A torn last element stays unread */
+	got -= got % size;
+	r->off += got;
+
+	return got / size;
+}
+
+/**
+ * bulk_view: point at up to n elements in the mapping, no copy.
+ * @r: mapped reader
+ * @size: element size
+ * @align: element alignment
+ * @n: elements wanted, returns elements available
+ *
+ * Returns NULL for a reader without a mapping, at the end of the file,
+ * or when the elements aren't aligned for their type in the file; read
+ * them with bulk_read() then.
+ */
+static inline const void *bulk_view(struct bulk_reader *r, size_t size,
+				    size_t align, size_t *n)
+{
+	const char *p;
+	size_t left;
+
+	if (!r->map || !size || (size_t)r->off >= r->map_len ||
+	    r->off % align) {
+		*n = 0;
+		return NULL;
+	}
+
+	left = (r->map_len - r->off) / size;
+	if (*n > left)
+		*n = left;
+	if (!*n)
+		return NULL;
+
+	p = r->map + r->off;
+	r->off += *n * size;
+
+	return p;
+}
+
+#define BULK_DEFINE(name, type)						\
+static inline ssize_t bulk_read_##name(struct bulk_reader *r, type *dst,	\
+				       size_t n)				\
+{									\
+	return bulk_read(r, dst, sizeof(type), n);			\
+}									\
+									\
+static inline const type *bulk_view_##name(struct bulk_reader *r,	\
+					   size_t *n)			\
+{									\
+	return bulk_view(r, sizeof(type), _Alignof(type), n);		\
+}
+
+BULK_DEFINE(int, int)
+BULK_DEFINE(i32, int32_t)
+BULK_DEFINE(u32, uint32_t)
+BULK_DEFINE(i64, int64_t)
+BULK_DEFINE(u64, uint64_t)
+BULK_DEFINE(double, double)
+BULK_DEFINE(threenum, struct threeNum)
+
+#endif /* RECORD_BULK_H */
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threenum.h"
+#include "record_file.h"
+#include "record_schema.h"
+#include "record_columnar.h"
+
+/*
+ * Converts program.bin to the columnar layout and runs scans on it.
+ *
+ *	record_columnar -w			program.bin -> program.col
+ *	record_columnar -s n2			sum of n2
+ *	record_columnar -m n3			min/max of n3
+ *	record_columnar -q 'n1>=100' -S n3	count and sum of n3 where n1 >= 100
+ *
+ *	-i <file>	row wise input instead of program.bin
+ *	-o <file>	columnar file instead of program.col
+ *
+ * gcc -O2 -mavx2 record_columnar.c -o record_columnar
+ */
+/* Field named by the len characters at s, -1 if none is */
+static int parse_field_len(const char *s, size_t len)
+{
+	if (len == 2 && !strncmp(s, "n1", 2))
+		return COL_N1;
+	if (len == 2 && !strncmp(s, "n2", 2))
+		return COL_N2;
+	if (len == 2 && !strncmp(s, "n3", 2))
+		return COL_N3;
+	return -1;
+}
+
+static int parse_field(const char *s)
+{
+	return parse_field_len(s, strlen(s));
+}
+
+/* "<field><op><value>", op one of < <= == >= > */
+static int parse_predicate(const char *s, int *field, enum col_op *op,
+			   int32_t *value)
+{
+	const char *p = s + strcspn(s, "<>=");
+	char *end;
+	long v;
+
+	*field = parse_field_len(s, p - s);
+	if (*field < 0)
+		return -1;
+
+	if (!strncmp(p, "<=", 2)) {
+		*op = COL_LE;
+		p += 2;
+	} else if (!strncmp(p, ">=", 2)) {
+		*op = COL_GE;
+		p += 2;
+	} else if (!strncmp(p, "==", 2)) {
+		*op = COL_EQ;
+		p += 2;
+	} else if (*p == '<') {
+		*op = COL_LT;
+		p++;
+	} else if (*p == '>') {
+		*op = COL_GT;
+		p++;
+	} else {
+		return -1;
+	}
+
+	errno = 0;
+	v = strtol(p, &end, 10);
+	if (end == p || *end || errno || v < INT32_MIN || v > INT32_MAX)
+		return -1;
+	*value = v;
+	return 0;
+}
+
+static int convert(const char *in, const char *out)
+{
+	const struct threeNum *num;
+	struct record_iter it;
+	struct record_map m;
+	struct col_writer cw;
+
+	if (threenum_file_map(&m, in, RECORD_ACCESS_SEQUENTIAL)) {
+		perror(in);
+		return 1;
+	}
+	if (col_writer_open(&cw, out)) {
+		perror(out);
+		return 1;
+	}
+
+	record_iter_init(&it, &m);
+	while ((num = record_iter_next(&it)) != NULL)
+		if (col_writer_append(&cw, num)) {
+			perror(out);
+			return 1;
+		}
+
+	if (col_writer_close(&cw)) {
+		perror(out);
+		return 1;
+	}
+	printf("%s: %zu records in %u row groups\n", out, m.count,
+	       (unsigned)((m.count + COL_GROUP_ROWS - 1) / COL_GROUP_ROWS));
+
+	record_map_close(&m);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *in = "program.bin", *out = "program.col";
+	const char *sum_arg = NULL, *minmax_arg = NULL, *pred_arg = NULL;
+	const char *filter_sum_arg = NULL;
+	int c, write = 0, field, sum_field = -1;
+	struct col_reader cr;
+	enum col_op op;
+	int32_t value, min, max;
+	uint64_t count;
+	int64_t sum;
+
+	while ((c = getopt(argc, argv, "wi:o:s:m:q:S:")) != -1)
+		switch (c) {
+		case 'w':
+			write = 1;
+			break;
+		case 'i':
+			in = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 's':
+			sum_arg = optarg;
+			break;
+		case 'm':
+			minmax_arg = optarg;
+			break;
+		case 'q':
+			pred_arg = optarg;
+			break;
+		case 'S':
+			filter_sum_arg = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-w] [-i in] [-o out] [-s field] "
+				"[-m field] [-q predicate [-S field]]\n", argv[0]);
+			return 1;
+		}
+
+	if (write)
+		return convert(in, out);
+
+	if (col_reader_open(&cr, out)) {
+		perror(out);
+		return 1;
+	}
+	printf("%s: %llu records in %u row groups\n", out,
+	       (unsigned long long)cr.rows, cr.ngroups);
+
+	if (sum_arg) {
+		field = parse_field(sum_arg);
+		if (field < 0) {
+			fprintf(stderr, "Unknown field %s\n", sum_arg);
+			return 1;
+		}
+		printf("sum %s: %lld\n", sum_arg, (long long)col_sum(&cr, field));
+	}
+
+	if (minmax_arg) {
+		field = parse_field(minmax_arg);
+		if (field < 0) {
+			fprintf(stderr, "Unknown field %s\n", minmax_arg);
+			return 1;
+		}
+		if (!col_minmax(&cr, field, &min, &max))
+			printf("%s min: %d\tmax: %d\n", minmax_arg, min, max);
+	}
+
+	if (pred_arg) {
+		if (parse_predicate(pred_arg, &field, &op, &value)) {
+			fprintf(stderr, "Bad predicate %s\n", pred_arg);
+			return 1;
+		}
+		if (filter_sum_arg) {
+			sum_field = parse_field(filter_sum_arg);
+			if (sum_field < 0) {
+				fprintf(stderr, "Unknown field %s\n", filter_sum_arg);
+				return 1;
+			}
+		}
+
+		count = col_filter(&cr, field, op, value, sum_field, &sum);
+		printf("%s: %llu rows", pred_arg, (unsigned long long)count);
+		if (sum_field >= 0)
+			printf(", sum %s: %lld", filter_sum_arg, (long long)sum);
+		printf("\n");
+	}
+
+	col_reader_close(&cr);
+	return 0;
+}
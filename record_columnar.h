@@ -0,0 +1,533 @@
+#ifndef RECORD_COLUMNAR_H
+#define RECORD_COLUMNAR_H
+
+/*
+ * Columnar struct threeNum files.
+ *
+ * Records are stored as row groups of up to COL_GROUP_ROWS rows. Inside
+ * a row group n1, n2 and n3 are separate int32 column blocks, each
+ * starting COL_ALIGN aligned, so a scan of one field reads only that
+ * field's blocks and feeds them straight to vector loads:
+ *
+ *	struct col_header
+ *	group 0: n1[rows] pad n2[rows] pad n3[rows] pad
+ *	group 1: ...
+ *	footer:  struct col_group[ngroups]
+ *	struct col_trailer
+ *
+ * The footer holds every block's offset and per-column min/max, so
+ * filters skip row groups that can't match and take whole groups that
+ * all match without looking at the predicate column.
+ *
+ * Scans use AVX2 when compiled for it, build with
+ *	gcc -O2 -mavx2 record_columnar.c
+ * and fall back to plain loops otherwise.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "threenum.h"
+#include "record_writer.h"
+#include "record_schema.h"
+
+#define COL_MAGIC	"TNCOLUMN"
+#define COL_VERSION	1
+#define COL_GROUP_ROWS	65536
+#define COL_ALIGN	64
+#define COL_FIELDS	3
+
+enum col_field {
+	COL_N1,
+	COL_N2,
+	COL_N3,
+};
+
+enum col_op {
+	COL_LT,
+	COL_LE,
+	COL_EQ,
+	COL_GE,
+	COL_GT,
+};
+
+struct col_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t group_rows;
+	char pad[COL_ALIGN - 16];
+};
+
+struct col_group {
+	uint64_t offset[COL_FIELDS];	/* File offset of each column block */
+	uint32_t rows;
+	uint32_t pad;
+	int32_t min[COL_FIELDS];
+	int32_t max[COL_FIELDS];
+};
+
+struct col_trailer {
+	uint64_t footer_offset;
+	uint64_t rows;
+	uint32_t ngroups;
+	uint32_t version;
+	char magic[8];
+};
+
+struct col_writer {
+	struct record_writer w;
+	int32_t *cols[COL_FIELDS];	/* Row group being filled */
+	uint32_t rows;
+	uint64_t total_rows;
+	struct col_group *groups;
+	uint32_t ngroups, groups_alloc;
+};
+
+struct col_reader {
+	const char *base;
+	size_t len;
+	const struct col_group *groups;
+	uint32_t ngroups;
+	uint64_t rows;
+};
+
+static inline size_t col_block_len(uint32_t rows)
+{
+	return ((size_t)rows * sizeof(int32_t) + COL_ALIGN - 1) &
+	       ~(size_t)(COL_ALIGN - 1);
+}
+
+/* v is COL_ALIGN aligned, rows > 0 */
+static inline void col_block_minmax(const int32_t *v, uint32_t rows,
+				    int32_t *min, int32_t *max)
+{
+	uint32_t r = 0;
+	int32_t lo = v[0], hi = v[0];
+#ifdef __AVX2__
+	__m256i vmin, vmax, x;
+	int32_t lanes[8];
+	int k;
+
+	if (rows >= 8) {
+		vmin = vmax = _mm256_load_si256((const __m256i *)v);
+		for (r = 8; r + 8 <= rows; r += 8) {
+			x = _mm256_load_si256((const __m256i *)(v + r));
+			vmin = _mm256_min_epi32(vmin, x);
+			vmax = _mm256_max_epi32(vmax, x);
+		}
+		_mm256_storeu_si256((__m256i *)lanes, vmin);
+		for (k = 0; k < 8; k++)
+			lo = lanes[k] < lo ? lanes[k] : lo;
+		_mm256_storeu_si256((__m256i *)lanes, vmax);
+		for (k = 0; k < 8; k++)
+			hi = lanes[k] > hi ? lanes[k] : hi;
+	}
+#endif
+	for (; r < rows; r++) {
+		lo = v[r] < lo ? v[r] : lo;
+		hi = v[r] > hi ? v[r] : hi;
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+/* Column blocks and the footer go out through the batched writer */
+static inline int col_writer_open(struct col_writer *cw, const char *path)
+{
+	struct col_header hdr;
+	int f;
+
+	memset(cw, 0, sizeof(*cw));
+	for (f = 0; f < COL_FIELDS; f++) {
+		cw->cols[f] = aligned_alloc(COL_ALIGN,
+					    col_block_len(COL_GROUP_ROWS));
+		if (!cw->cols[f])
+			goto err;
+	}
+
+	if (record_writer_open(&cw->w, path, sizeof(int32_t), 0, 0))
+		goto err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, COL_MAGIC, 8);
+	hdr.version = COL_VERSION;
+	hdr.group_rows = COL_GROUP_ROWS;
+	if (record_writer_write(&cw->w, &hdr, sizeof(hdr))) {
+		record_writer_close(&cw->w);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	for (f = 0; f < COL_FIELDS; f++)
+		free(cw->cols[f]);
+	return -1;
+}
+
+static inline int col_writer_flush_group(struct col_writer *cw)
+{
+	struct col_group *g, *tmp;
+	size_t len = col_block_len(cw->rows);
+	int f;
+
+	if (!cw->rows)
+		return 0;
+
+	if (cw->ngroups == cw->groups_alloc) {
+		cw->groups_alloc = cw->groups_alloc ? 2 * cw->groups_alloc : 16;
+		tmp = realloc(cw->groups, cw->groups_alloc * sizeof(*tmp));
+		if (!tmp)
+			return -1;
+		cw->groups = tmp;
+	}
+
+	g = &cw->groups[cw->ngroups++];
+	memset(g, 0, sizeof(*g));
+	g->rows = cw->rows;
+
+	for (f = 0; f < COL_FIELDS; f++) {
+		col_block_minmax(cw->cols[f], cw->rows, &g->min[f], &g->max[f]);
+
+		/* Zero the padding up to the next aligned block */
+		memset((char *)cw->cols[f] + cw->rows * sizeof(int32_t), 0,
+		       len - cw->rows * sizeof(int32_t));
+
+		g->offset[f] = record_writer_offset(&cw->w);
+		if (record_writer_write(&cw->w, cw->cols[f], len))
+			return -1;
+	}
+
+	cw->rows = 0;
+	return 0;
+}
+
+static inline int col_writer_append(struct col_writer *cw,
+				    const struct threeNum *num)
+{
+	struct threenum_columns c = {
+		cw->cols[COL_N1] + cw->rows,
+		cw->cols[COL_N2] + cw->rows,
+		cw->cols[COL_N3] + cw->rows,
+	};
+
+	threenum_split(&c, num, 1);
+	cw->total_rows++;
+
+	if (++cw->rows == COL_GROUP_ROWS)
+		return col_writer_flush_group(cw);
+	return 0;
+}
+
+static inline int col_writer_close(struct col_writer *cw)
+{
+	struct col_trailer t;
+	int ret, f;
+
+	ret = col_writer_flush_group(cw);
+
+	memset(&t, 0, sizeof(t));
+	t.footer_offset = record_writer_offset(&cw->w);
+	t.rows = cw->total_rows;
+	t.ngroups = cw->ngroups;
+	t.version = COL_VERSION;
+	memcpy(t.magic, COL_MAGIC, 8);
+
+	if (!ret && cw->ngroups)
+		ret = record_writer_write(&cw->w, cw->groups,
+					  cw->ngroups * sizeof(*cw->groups));
+	if (!ret)
+		ret = record_writer_write(&cw->w, &t, sizeof(t));
+	if (record_writer_close(&cw->w))
+		ret = -1;
+
+	for (f = 0; f < COL_FIELDS; f++)
+		free(cw->cols[f]);
+	free(cw->groups);
+
+	return ret;
+}
+
+static inline int col_reader_open(struct col_reader *cr, const char *path)
+{
+	const struct col_trailer *t;
+	const struct col_header *hdr;
+	struct stat st;
+	void *base;
+	uint64_t rows;
+	uint32_t g;
+	int fd, f;
+
+	memset(cr, 0, sizeof(*cr));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr) + sizeof(*t)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	cr->base = base;
+	cr->len = st.st_size;
+	hdr = base;
+	t = (const struct col_trailer *)(cr->base + cr->len - sizeof(*t));
+	if (memcmp(hdr->magic, COL_MAGIC, 8) || hdr->version != COL_VERSION ||
+	    memcmp(t->magic, COL_MAGIC, 8) || t->version != COL_VERSION)
+		goto bad;
+
+	/* Footer between header and trailer, sized by ngroups; no sums wrap */
+	if (t->footer_offset < sizeof(*hdr) ||
+	    t->footer_offset > cr->len - sizeof(*t) ||
+	    cr->len - sizeof(*t) - t->footer_offset !=
+	    (uint64_t)t->ngroups * sizeof(struct col_group))
+		goto bad;
+
+	cr->groups = (const struct col_group *)(cr->base + t->footer_offset);
+	cr->ngroups = t->ngroups;
+	cr->rows = t->rows;
+
+	for (g = 0, rows = 0; g < cr->ngroups; g++) {
+		if (cr->groups[g].rows > COL_GROUP_ROWS)
+			goto bad;
+		rows += cr->groups[g].rows;
+		for (f = 0; f < COL_FIELDS; f++)
+			if (cr->groups[g].offset[f] % COL_ALIGN ||
+			    cr->groups[g].offset[f] < sizeof(*hdr) ||
+			    cr->groups[g].offset[f] > t->footer_offset ||
+			    col_block_len(cr->groups[g].rows) >
+			    t->footer_offset - cr->groups[g].offset[f])
+				goto bad;
+	}
+	if (rows != cr->rows)
+		goto bad;
+
+	/* Scans go column block by column block */
+	madvise(base, cr->len, MADV_SEQUENTIAL);
+	return 0;
+
+bad:
+	munmap(base, cr->len);
+	errno = EINVAL;
+	return -1;
+}
+
+static inline void col_reader_close(struct col_reader *cr)
+{
+	munmap((void *)cr->base, cr->len);
+}
+
+static inline const int32_t *col_block(const struct col_reader *cr,
+				       uint32_t g, int field)
+{
+	return (const int32_t *)(cr->base + cr->groups[g].offset[field]);
+}
+
+/* Kernels over one column block */
+
+static inline int64_t col_block_sum(const int32_t *v, uint32_t rows)
+{
+	int64_t sum = 0;
+	uint32_t r = 0;
+#ifdef __AVX2__
+	__m256i acc = _mm256_setzero_si256();
+	__m256i x;
+	int64_t lanes[4];
+
+	for (; r + 8 <= rows; r += 8) {
+		x = _mm256_load_si256((const __m256i *)(v + r));
+		acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(
+					_mm256_castsi256_si128(x)));
+		acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(
+					_mm256_extracti128_si256(x, 1)));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; r < rows; r++)
+		sum += v[r];
+
+	return sum;
+}
+
+static inline int col_match(int32_t x, enum col_op op, int32_t value)
+{
+	switch (op) {
+	case COL_LT: return x < value;
+	case COL_LE: return x <= value;
+	case COL_EQ: return x == value;
+	case COL_GE: return x >= value;
+	case COL_GT: return x > value;
+	}
+	return 0;
+}
+
+#ifdef __AVX2__
+static inline __m256i col_match8(__m256i x, enum col_op op, __m256i value)
+{
+	__m256i ones = _mm256_set1_epi32(-1);
+
+	switch (op) {
+	case COL_LT: return _mm256_cmpgt_epi32(value, x);
+	case COL_LE: return _mm256_xor_si256(_mm256_cmpgt_epi32(x, value), ones);
+	case COL_EQ: return _mm256_cmpeq_epi32(x, value);
+	case COL_GE: return _mm256_xor_si256(_mm256_cmpgt_epi32(value, x), ones);
+	case COL_GT: return _mm256_cmpgt_epi32(x, value);
+	}
+	return _mm256_setzero_si256();
+}
+#endif
+
+/*
+ * Rows of pred where "pred op value" holds: returns how many, adds up the
+ * matching values of sum (may be NULL) into *sum.
+ */
+static inline uint64_t col_block_filter(const int32_t *pred,
+					const int32_t *sum_col, uint32_t rows,
+					enum col_op op, int32_t value,
+					int64_t *sum)
+{
+	uint64_t count = 0;
+	int64_t s = 0;
+	uint32_t r = 0;
+#ifdef __AVX2__
+	__m256i vvalue = _mm256_set1_epi32(value);
+	__m256i acc = _mm256_setzero_si256();
+	__m256i m, y;
+	int64_t lanes[4];
+
+	for (; r + 8 <= rows; r += 8) {
+		m = col_match8(_mm256_load_si256((const __m256i *)(pred + r)),
+			       op, vvalue);
+		count += __builtin_popcount(_mm256_movemask_ps(
+						_mm256_castsi256_ps(m)));
+		if (sum_col) {
+			y = _mm256_and_si256(m, _mm256_load_si256(
+					(const __m256i *)(sum_col + r)));
+			acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(
+						_mm256_castsi256_si128(y)));
+			acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(
+						_mm256_extracti128_si256(y, 1)));
+		}
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; r < rows; r++)
+		if (col_match(pred[r], op, value)) {
+			count++;
+			if (sum_col)
+				s += sum_col[r];
+		}
+
+	*sum += s;
+	return count;
+}
+
+/* Scans over the whole file */
+
+static inline int64_t col_sum(const struct col_reader *cr, int field)
+{
+	int64_t sum = 0;
+	uint32_t g;
+
+	for (g = 0; g < cr->ngroups; g++)
+		sum += col_block_sum(col_block(cr, g, field), cr->groups[g].rows);
+
+	return sum;
+}
+
+/* The footer already has them, no column block is read */
+static inline int col_minmax(const struct col_reader *cr, int field,
+			     int32_t *min, int32_t *max)
+{
+	uint32_t g;
+
+	if (!cr->ngroups)
+		return -1;
+
+	*min = cr->groups[0].min[field];
+	*max = cr->groups[0].max[field];
+	for (g = 1; g < cr->ngroups; g++) {
+		if (cr->groups[g].min[field] < *min)
+			*min = cr->groups[g].min[field];
+		if (cr->groups[g].max[field] > *max)
+			*max = cr->groups[g].max[field];
+	}
+
+	return 0;
+}
+
+/**
+ * col_filter: count rows where "field op value", summing another field.
+ * @cr: reader
+ * @field: predicate column
+ * @op: comparison
+ * @value: right hand side
+ * @sum_field: column summed over the matching rows, -1 for none
+ * @sum: returns the sum
+ *
+ * Row groups are skipped or taken whole from their footer min/max when
+ * possible; only the predicate and sum columns are ever read.
+ */
+static inline uint64_t col_filter(const struct col_reader *cr, int field,
+				  enum col_op op, int32_t value, int sum_field,
+				  int64_t *sum)
+{
+	const struct col_group *grp;
+	uint64_t count = 0;
+	uint32_t g;
+	int none, all;
+
+	*sum = 0;
+	for (g = 0; g < cr->ngroups; g++) {
+		grp = &cr->groups[g];
+		/* Every predicate is a half line or a point */
+		if (op == COL_EQ)
+			none = value < grp->min[field] || value > grp->max[field];
+		else
+			none = !col_match(grp->min[field], op, value) &&
+			       !col_match(grp->max[field], op, value);
+		all = col_match(grp->min[field], op, value) &&
+		      col_match(grp->max[field], op, value);
+
+		if (none)
+			continue;
+
+		if (all) {
+			count += grp->rows;
+			if (sum_field >= 0)
+				*sum += col_block_sum(col_block(cr, g, sum_field),
+						      grp->rows);
+			continue;
+		}
+
+		count += col_block_filter(col_block(cr, g, field),
+					  sum_field >= 0 ?
+					  col_block(cr, g, sum_field) : NULL,
+					  grp->rows, op, value, sum);
+	}
+
+	return count;
+}
+
+#endif /* RECORD_COLUMNAR_H */
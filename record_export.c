@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "threenum.h"
+#include "record_export.h"
+
+/*
+ * Streams program.bin, or some of its records, to stdout or a file
+ * without copying it through user space.
+ *
+ *	record_export | ssh host 'cat > program.bin'	whole file, header too
+ *	record_export -r 1000:500 > part.bin		records 1000..1499
+ *	record_export -o copy.bin			copy_file_range()
+ *	record_export >> all.bin			appends, one copy
+ *
+ *	-f <file>	record file instead of program.bin
+ *	-r <first[:count]>	raw records only, no header, to the end
+ *			without count
+ */
+int main(int argc, char **argv)
+{
+	const char *path = "program.bin", *out = NULL;
+	uint64_t first = 0, count = RECORD_EXPORT_FILE;
+	enum export_method method;
+	int64_t sent;
+	char *end;
+	int c, fd = STDOUT_FILENO;
+
+	while ((c = getopt(argc, argv, "f:r:o:")) != -1)
+		switch (c) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'r':
+			first = strtoull(optarg, &end, 0);
+			count = *end == ':' ? strtoull(end + 1, NULL, 0) :
+					      RECORD_EXPORT_REST;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f file] [-r first[:count]] "
+				"[-o out]\n", argv[0]);
+			return 1;
+		}
+
+	if (out) {
+		fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(out);
+			return 1;
+		}
+	}
+
+	sent = record_export(path, sizeof(struct threeNum), first, count, fd,
+			     &method);
+	if (sent < 0) {
+		perror(path);
+		return 1;
+	}
+	fprintf(stderr, "%s: %lld records sent with %s\n", path,
+		(long long)sent, export_method_names[method]);
+
+	if (out && close(fd)) {
+		perror(out);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,276 @@
+#ifndef RECORD_EXPORT_H
+#define RECORD_EXPORT_H
+
+/*
+ * Zero-copy export of record files.
+ *
+ * Streams a whole record file, or a range of its records, to another
+ * file descriptor without the data passing through user space:
+ *
+ *	regular file	copy_file_range(), which may share extents (reflink)
+ *	pipe		splice() from the page cache
+ *	socket, other	sendfile()
+ *	O_APPEND	pread() and write() through a small buffer
+ *
+ * Each falls back to sendfile() when the kernel or filesystem can't do
+ * it (EXDEV across filesystems on old kernels, EINVAL, ENOSYS). None of
+ * the zero-copy calls write to an O_APPEND file (copy_file_range() fails
+ * with EBADF, sendfile() and splice() with EINVAL), so appending, as in
+ * "record_export >> out.bin", costs one copy. A non-blocking destination
+ * is waited on with poll() when it's full. Record ranges are resolved
+ * through the record_file.h header, so the caller names records, not
+ * byte offsets. A whole file still being appended to (RECORD_FILE_LIVE)
+ * goes out as the finished file of its committed records: header and
+ * block checksums are built here, only the records are sent zero-copy.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "record_file.h"
+
+enum export_method {
+	EXPORT_COPY_FILE_RANGE,
+	EXPORT_SPLICE,
+	EXPORT_SENDFILE,
+	EXPORT_WRITE,
+};
+
+static const char *const export_method_names[] = {
+	"copy_file_range", "splice", "sendfile", "write",
+};
+
+/* Kernel transfers are capped at a bit under 2 GB per call anyway */
+#define EXPORT_CHUNK	(1 << 30)
+
+/* Bounce buffer of EXPORT_WRITE */
+#define EXPORT_BOUNCE	(64 << 10)
+
+/* One buffer's worth, *off only moves past what was written */
+static inline ssize_t export_write(int in_fd, off_t *off, int out_fd,
+				   size_t len)
+{
+	char buf[EXPORT_BOUNCE];
+	ssize_t n;
+
+	n = pread(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf), *off);
+	if (n <= 0)
+		return n;
+	n = write(out_fd, buf, n);
+	if (n > 0)
+		*off += n;
+
+	return n;
+}
+
+static inline ssize_t export_once(enum export_method method, int in_fd,
+				  off_t *off, int out_fd, size_t len)
+{
+	if (len > EXPORT_CHUNK)
+		len = EXPORT_CHUNK;
+
+	switch (method) {
+	case EXPORT_COPY_FILE_RANGE:
+		return copy_file_range(in_fd, off, out_fd, NULL, len, 0);
+	case EXPORT_SPLICE:
+		return splice(in_fd, off, out_fd, NULL, len, SPLICE_F_MOVE);
+	case EXPORT_SENDFILE:
+		break;
+	case EXPORT_WRITE:
+		return export_write(in_fd, off, out_fd, len);
+	}
+
+	return sendfile(out_fd, in_fd, off, len);
+}
+
+/* Send a buffer of ours, waiting on a full non-blocking out_fd */
+static inline int export_buf(int out_fd, const void *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = out_fd, .events = POLLOUT };
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(out_fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * export_range: send len bytes of in_fd at off to out_fd.
+ * @in_fd: regular file
+ * @off: offset in it
+ * @len: bytes
+ * @out_fd: file, pipe or socket, written at its current position
+ * @method: returns the method that did the work, may be NULL
+ *
+ * Returns 0, or -1 with errno set.
+ */
+static inline int export_range(int in_fd, off_t off, size_t len, int out_fd,
+			       enum export_method *method)
+{
+	enum export_method m = EXPORT_SENDFILE;
+	struct pollfd pfd = { .fd = out_fd, .events = POLLOUT };
+	struct stat st;
+	ssize_t ret;
+	int flags;
+
+	if (!fstat(out_fd, &st)) {
+		if (S_ISREG(st.st_mode))
+			m = EXPORT_COPY_FILE_RANGE;
+		else if (S_ISFIFO(st.st_mode))
+			m = EXPORT_SPLICE;
+	}
+	/* Splicing into a pipe ignores O_APPEND, everything else rejects it */
+	flags = fcntl(out_fd, F_GETFL);
+	if (flags >= 0 && (flags & O_APPEND) && m != EXPORT_SPLICE)
+		m = EXPORT_WRITE;
+
+	while (len) {
+		ret = export_once(m, in_fd, &off, out_fd, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Non-blocking destination is full */
+			if (errno == EAGAIN) {
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					return -1;
+				continue;
+			}
+			if (m != EXPORT_SENDFILE && m != EXPORT_WRITE &&
+			    (errno == EXDEV || errno == EINVAL ||
+			     errno == ENOSYS || errno == EOPNOTSUPP)) {
+				m = EXPORT_SENDFILE;
+				continue;
+			}
+			return -1;
+		}
+		if (!ret) {
+			/* Source shorter than its header says */
+			errno = EIO;
+			return -1;
+		}
+		len -= ret;
+	}
+
+	if (method)
+		*method = m;
+	return 0;
+}
+
+/* record_export() counts */
+#define RECORD_EXPORT_FILE	UINT64_MAX
+#define RECORD_EXPORT_REST	(UINT64_MAX - 1)
+
+/**
+ * record_export: send records of a record file to out_fd.
+ * @path: record file, with or without a record_file.h header
+ * @rec_size: record size
+ * @first: first record
+ * @count: records, clamped to the file; RECORD_EXPORT_REST for all from
+ *	first on. Any range goes out as raw records, only RECORD_EXPORT_FILE
+ *	(with first 0) sends the file as it is, header and checksums included
+ * @out_fd: destination
+ * @method: returns the method used, may be NULL
+ *
+ * Returns the number of records sent, or -1 with errno set.
+ */
+static inline int64_t record_export(const char *path, size_t rec_size,
+				    uint64_t first, uint64_t count, int out_fd,
+				    enum export_method *method)
+{
+	int whole = count == RECORD_EXPORT_FILE;
+	struct record_file_header hdr;
+	uint32_t *crcs = NULL;
+	size_t ncrcs = 0, b, recs;
+	struct record_map m;
+	off_t off;
+	size_t len;
+	int fd, ret;
+
+	if (record_file_map(&m, path, rec_size, NULL, RECORD_ACCESS_RANDOM))
+		return -1;
+
+	if (whole && first) {
+		record_map_close(&m);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (first > m.count) {
+		record_map_close(&m);
+		errno = ERANGE;
+		return -1;
+	}
+	if (count > m.count - first)
+		count = m.count - first;
+
+	if (whole && m.data != m.base && !m.crcs) {
+		/* Live: the map runs to the end of the preallocated extent */
+		hdr = *(const struct record_file_header *)m.base;
+		hdr.count = m.count;
+		hdr.flags &= ~RECORD_FILE_LIVE;
+		hdr.header_crc = record_file_header_crc(hdr);
+
+		ncrcs = record_file_nblocks(&hdr);
+		crcs = malloc(ncrcs * sizeof(*crcs) + 1);
+		if (!crcs) {
+			record_map_close(&m);
+			return -1;
+		}
+		for (b = 0; b < ncrcs; b++) {
+			recs = m.count - b * m.block_records;
+			if (recs > m.block_records)
+				recs = m.block_records;
+			crcs[b] = crc32c(0, m.data +
+					 b * m.block_records * rec_size,
+					 recs * rec_size);
+		}
+
+		off = sizeof(hdr);
+		len = m.count * rec_size;
+	} else if (whole) {
+		off = 0;
+		len = m.len;
+	} else {
+		off = (m.data - m.base) + first * rec_size;
+		len = count * rec_size;
+	}
+	record_map_close(&m);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		free(crcs);
+		return -1;
+	}
+	ret = crcs && export_buf(out_fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = export_range(fd, off, len, out_fd, method);
+	if (!ret && crcs)
+		ret = export_buf(out_fd, crcs, ncrcs * sizeof(*crcs));
+	close(fd);
+	free(crcs);
+
+	return ret ? -1 : (int64_t)count;
+}
+
+#endif /* RECORD_EXPORT_H */
@@ -0,0 +1,408 @@
+#ifndef RECORD_FILE_H
+#define RECORD_FILE_H
+
+/*
+ * Self-describing record files.
+ *
+ *	struct record_file_header	64 bytes
+ *	records				count * rec_size bytes
+ *	uint32_t crc[nblocks]		CRC32C of every block_records records
+ *
+ * The header names the record schema, the record size and the byte order
+ * the file was written in, and carries its own CRC32C, so a reader on
+ * another ABI or byte order refuses the file instead of misreading it.
+ * Records stay contiguous, so the file can still be mapped and indexed
+ * directly (record_reader.h); the checksums live after them and are only
+ * read by record_file_verify().
+ *
+ * A file still being appended to through a mapping (record_mmap.h) has
+ * RECORD_FILE_LIVE set: count is the committed record count, published
+ * on its own, the file runs on past the records into preallocated space
+ * and there are no checksums yet. The header CRC of a live file is taken
+ * with count 0, so it stays valid while count moves.
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction when the CPU has it, several
+ * GB/s per core, and a table otherwise.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+#include "record_writer.h"
+#include "record_reader.h"
+
+#define RECORD_FILE_MAGIC	"RECFILE"
+#define RECORD_FILE_VERSION	1
+#define RECORD_FILE_ENDIAN	0x01020304
+#define RECORD_FILE_BLOCK_BYTES	(1 << 20)
+#define RECORD_FILE_LIVE	0x01	/* Header flags: being appended to */
+
+/* record_file_verify() results besides a bad block */
+#define RECORD_FILE_VERIFY_OK	(-1)
+#define RECORD_FILE_VERIFY_NONE	(-2)
+
+struct record_file_header {
+	char magic[8];
+	uint32_t endian;	/* RECORD_FILE_ENDIAN in the writer's byte order */
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t rec_size;
+	uint32_t block_records;
+	uint64_t count;
+	char schema[24];	/* e.g. "n1:i32,n2:i32,n3:i32" */
+	uint32_t header_crc;	/* CRC32C of the header with this field 0 */
+	uint32_t flags;
+};
+
+/* CRC32C (Castagnoli), reflected polynomial 0x82F63B78 */
+
+static uint32_t crc32c_table[256];
+
+static inline void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+}
+
+static inline uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (!crc32c_table[1])
+		crc32c_init_table();
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t crc64 = crc, v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = (uint32_t)crc64;
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/* CRC32C of buf continuing from crc, 0 to start */
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef __x86_64__
+	static int has_sse42 = -1;
+
+	if (has_sse42 < 0)
+		has_sse42 = __builtin_cpu_supports("sse4.2");
+	if (has_sse42)
+		return ~crc32c_hw(~crc, buf, len);
+#endif
+	return ~crc32c_sw(~crc, buf, len);
+}
+
+static inline uint32_t record_file_header_crc(struct record_file_header hdr)
+{
+	hdr.header_crc = 0;
+	if (hdr.flags & RECORD_FILE_LIVE)
+		hdr.count = 0;
+	return crc32c(0, &hdr, sizeof(hdr));
+}
+
+/* Writer */
+
+struct record_file_writer {
+	struct record_writer w;
+	struct record_file_header hdr;
+	uint32_t crc;		/* Of the block being written */
+	uint32_t in_block;	/* Records in it */
+	size_t crc_from;	/* Start of unchecksummed records in w.buf */
+	uint32_t *crcs;
+	size_t ncrcs, crcs_alloc;
+};
+
+/**
+ * record_file_open: create a record file.
+ * @fw: writer
+ * @path: file, truncated
+ * @rec_size: size of one record
+ * @schema: schema string stored in the header, checked by readers
+ * @buf_size: batched writer buffer size, 0 for the default
+ * @flush_threshold: batched writer flush threshold, 0 for the default
+ */
+static inline int record_file_open(struct record_file_writer *fw,
+				   const char *path, size_t rec_size,
+				   const char *schema, size_t buf_size,
+				   size_t flush_threshold)
+{
+	memset(fw, 0, sizeof(*fw));
+
+	if (strlen(schema) >= sizeof(fw->hdr.schema)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(fw->hdr.magic, RECORD_FILE_MAGIC, sizeof(RECORD_FILE_MAGIC));
+	fw->hdr.endian = RECORD_FILE_ENDIAN;
+	fw->hdr.version = RECORD_FILE_VERSION;
+	fw->hdr.header_size = sizeof(fw->hdr);
+	fw->hdr.rec_size = rec_size;
+	fw->hdr.block_records = RECORD_FILE_BLOCK_BYTES / rec_size ?
+				RECORD_FILE_BLOCK_BYTES / rec_size : 1;
+	strcpy(fw->hdr.schema, schema);
+
+	if (record_writer_open(&fw->w, path, rec_size, buf_size,
+			       flush_threshold))
+		return -1;
+
+	/* Placeholder, the real one goes in on close with the count */
+	if (record_writer_write(&fw->w, &fw->hdr, sizeof(fw->hdr))) {
+		record_writer_close(&fw->w);
+		return -1;
+	}
+	fw->crc_from = fw->w.fill;
+
+	return 0;
+}
+
+static inline int record_file_end_block(struct record_file_writer *fw)
+{
+	uint32_t *tmp;
+
+	if (fw->ncrcs == fw->crcs_alloc) {
+		fw->crcs_alloc = fw->crcs_alloc ? 2 * fw->crcs_alloc : 64;
+		tmp = realloc(fw->crcs, fw->crcs_alloc * sizeof(*tmp));
+		if (!tmp)
+			return -1;
+		fw->crcs = tmp;
+	}
+
+	fw->crcs[fw->ncrcs++] = fw->crc;
+	fw->crc = 0;
+	fw->in_block = 0;
+
+	return 0;
+}
+
+/* Checksum the records buffered since the last call */
+static inline void record_file_crc_pending(struct record_file_writer *fw)
+{
+	fw->crc = crc32c(fw->crc, fw->w.buf + fw->crc_from,
+			 fw->w.fill - fw->crc_from);
+	fw->crc_from = fw->w.fill;
+}
+
+/*
+ * A CRC call per 12 byte record costs more than the write itself, so
+ * records are checksummed in the writer's buffer in one pass right
+ * before it is flushed or a block ends.
+ */
+static inline int record_file_append(struct record_file_writer *fw,
+				     const void *rec)
+{
+	struct record_writer *w = &fw->w;
+	size_t next = w->fill + w->rec_size;
+
+	fw->hdr.count++;
+	fw->in_block++;
+
+	if (next <= w->buf_size && next < w->flush_threshold &&
+	    fw->in_block < fw->hdr.block_records)
+		return record_writer_append(w, rec);
+
+	/* This append flushes or ends the block */
+	record_file_crc_pending(fw);
+	fw->crc = crc32c(fw->crc, rec, w->rec_size);
+	if (record_writer_append(w, rec))
+		return -1;
+	fw->crc_from = w->fill;
+
+	if (fw->in_block == fw->hdr.block_records)
+		return record_file_end_block(fw);
+
+	return 0;
+}
+
+/* Write the checksums and the final header */
+static inline int record_file_close(struct record_file_writer *fw)
+{
+	int ret = 0;
+
+	record_file_crc_pending(fw);
+	if (fw->in_block)
+		ret = record_file_end_block(fw);
+	if (!ret && fw->ncrcs)
+		ret = record_writer_write(&fw->w, fw->crcs,
+					  fw->ncrcs * sizeof(*fw->crcs));
+	if (!ret)
+		ret = record_writer_finish(&fw->w);
+
+	fw->hdr.header_crc = record_file_header_crc(fw->hdr);
+	if (!ret && pwrite(fw->w.fd, &fw->hdr, sizeof(fw->hdr), 0) !=
+		    sizeof(fw->hdr))
+		ret = -1;
+
+	if (record_writer_close(&fw->w))
+		ret = -1;
+	free(fw->crcs);
+	fw->crcs = NULL;
+
+	return ret;
+}
+
+/* Reader */
+
+/**
+ * record_file_check_header: validate a header read from a file.
+ * @hdr: header
+ * @rec_size: record size the caller expects
+ * @schema: schema the caller expects, NULL to accept any
+ *
+ * Returns 0, or -1 with errno EPROTO for another byte order or version,
+ * EINVAL for a different record type and EBADMSG for a corrupt header.
+ */
+static inline int record_file_check_header(const struct record_file_header *hdr,
+					   size_t rec_size, const char *schema)
+{
+	if (memcmp(hdr->magic, RECORD_FILE_MAGIC, sizeof(RECORD_FILE_MAGIC))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (hdr->endian != RECORD_FILE_ENDIAN ||
+	    hdr->version > RECORD_FILE_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (hdr->header_crc != record_file_header_crc(*hdr) ||
+	    hdr->header_size != sizeof(*hdr) || !hdr->block_records) {
+		errno = EBADMSG;
+		return -1;
+	}
+	if (hdr->rec_size != rec_size ||
+	    (schema && strncmp(hdr->schema, schema, sizeof(hdr->schema)))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline size_t record_file_nblocks(const struct record_file_header *hdr)
+{
+	return (hdr->count + hdr->block_records - 1) / hdr->block_records;
+}
+
+/**
+ * record_file_map: map a record file for reading.
+ * @m: returns the mapping
+ * @path: file
+ * @rec_size: record size expected
+ * @schema: schema expected, NULL to accept any
+ * @access: expected access pattern
+ *
+ * Files without a header, written before it existed, are accepted as raw
+ * records as long as their size is a multiple of rec_size.
+ */
+static inline int record_file_map(struct record_map *m, const char *path,
+				  size_t rec_size, const char *schema,
+				  enum record_access access)
+{
+	const struct record_file_header *hdr;
+
+	if (record_map_open(m, path, 1, access))
+		return -1;
+
+	hdr = (const struct record_file_header *)m->base;
+	if (m->len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, RECORD_FILE_MAGIC, sizeof(RECORD_FILE_MAGIC))) {
+		/* Raw struct dump */
+		if (m->len % rec_size) {
+			record_map_close(m);
+			errno = EINVAL;
+			return -1;
+		}
+		m->rec_size = rec_size;
+		m->count = m->len / rec_size;
+		return 0;
+	}
+
+	if (record_file_check_header(hdr, rec_size, schema))
+		goto err;
+
+	m->data = m->base + sizeof(*hdr);
+	m->rec_size = rec_size;
+	m->block_records = hdr->block_records;
+	m->count = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+
+	/* A count past the end of the file, not a product that wraps */
+	if (m->count > (m->len - sizeof(*hdr)) / rec_size) {
+		errno = EBADMSG;
+		goto err;
+	}
+
+	/* Live: records up to the committed count, no checksums yet */
+	if (hdr->flags & RECORD_FILE_LIVE)
+		return 0;
+
+	if (m->len != sizeof(*hdr) + m->count * rec_size +
+		      record_file_nblocks(hdr) * sizeof(uint32_t)) {
+		errno = EBADMSG;
+		goto err;
+	}
+	m->crcs = (const uint32_t *)(m->data + m->count * rec_size);
+
+	return 0;
+
+err:
+	record_map_close(m);
+	return -1;
+}
+
+/*
+ * Index of the first block failing its CRC, RECORD_FILE_VERIFY_OK if all
+ * are good, RECORD_FILE_VERIFY_NONE for a file without checksums (raw, or
+ * still being appended to).
+ */
+static inline ssize_t record_file_verify(const struct record_map *m)
+{
+	size_t b, nblocks, recs;
+
+	if (!m->crcs)
+		return RECORD_FILE_VERIFY_NONE;
+
+	nblocks = (m->count + m->block_records - 1) / m->block_records;
+	for (b = 0; b < nblocks; b++) {
+		recs = m->count - b * m->block_records;
+		if (recs > m->block_records)
+			recs = m->block_records;
+		if (crc32c(0, m->data + b * m->block_records * m->rec_size,
+			   recs * m->rec_size) != m->crcs[b])
+			return b;
+	}
+
+	return RECORD_FILE_VERIFY_OK;
+}
+
+#endif /* RECORD_FILE_H */
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threenum.h"
+#include "record_file.h"
+#include "record_schema.h"
+#include "record_index.h"
+
+/*
+ * Builds and queries a secondary index on one field of program.bin.
+ *
+ *	record_index -b n1		index n1 into program.bin.idx
+ *	record_index -u			index records appended since
+ *	record_index -k 42		records with the indexed field == 42
+ *	record_index -r 100:200		records with 100 <= field <= 200
+ *
+ *	-f <file>	data file instead of program.bin
+ *	-x <file>	index file instead of <data file>.idx
+ *	-c		only count matches
+ */
+#define PRINT_MAX	20
+
+static int parse_field(const char *s)
+{
+	if (!strcmp(s, "n1"))
+		return 0;
+	if (!strcmp(s, "n2"))
+		return 1;
+	if (!strcmp(s, "n3"))
+		return 2;
+	return -1;
+}
+
+/* An int32 key at s, *end past it; -1 if there is none or it's too big */
+static int parse_key(const char *s, char **end, int32_t *key)
+{
+	long v;
+
+	errno = 0;
+	v = strtol(s, end, 0);
+	if (*end == s || errno || v < INT32_MIN || v > INT32_MAX)
+		return -1;
+	*key = v;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "program.bin";
+	char *index_path = NULL;
+	int c, field = -1, update = 0, query = 0, count_only = 0;
+	int32_t lo = 0, hi = 0;
+	const struct threeNum *num;
+	struct index_cursor cur;
+	struct record_index ix;
+	struct record_map m;
+	uint64_t rec, matches = 0;
+	char *end;
+
+	while ((c = getopt(argc, argv, "b:uk:r:f:x:c")) != -1)
+		switch (c) {
+		case 'b':
+			field = parse_field(optarg);
+			if (field < 0) {
+				fprintf(stderr, "Unknown field %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'u':
+			update = 1;
+			break;
+		case 'k':
+			if (parse_key(optarg, &end, &lo) || *end) {
+				fprintf(stderr, "Key is a 32-bit integer\n");
+				return 1;
+			}
+			hi = lo;
+			query = 1;
+			break;
+		case 'r':
+			if (parse_key(optarg, &end, &lo) || *end != ':' ||
+			    parse_key(end + 1, &end, &hi) || *end) {
+				fprintf(stderr, "Range is lo:hi, "
+					"32-bit integers\n");
+				return 1;
+			}
+			query = 1;
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'x':
+			index_path = optarg;
+			break;
+		case 'c':
+			count_only = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f file] [-x index] "
+				"[-b field | -u | -k key | -r lo:hi] [-c]\n",
+				argv[0]);
+			return 1;
+		}
+
+	if (!index_path) {
+		index_path = malloc(strlen(path) + 5);
+		if (!index_path) {
+			perror("malloc");
+			return 1;
+		}
+		sprintf(index_path, "%s.idx", path);
+	}
+
+	if (threenum_file_map(&m, path, query ? RECORD_ACCESS_RANDOM :
+						RECORD_ACCESS_SEQUENTIAL)) {
+		perror(path);
+		return 1;
+	}
+
+	if (field >= 0 && record_index_build(&m, field, index_path)) {
+		perror(index_path);
+		return 1;
+	}
+	if (update && record_index_update(&m, index_path)) {
+		perror(index_path);
+		return 1;
+	}
+
+	if (record_index_open(&ix, index_path)) {
+		perror(index_path);
+		return 1;
+	}
+	if (ix.hdr->records != m.count) {
+		fprintf(stderr, "%s: indexes %llu records, %s has %zu; "
+			"update it with -u or rebuild it with -b\n",
+			index_path, (unsigned long long)ix.hdr->records, path,
+			m.count);
+		return 1;
+	}
+	printf("%s: n%u, %llu records, %llu + %llu entries\n", index_path,
+	       ix.hdr->field + 1, (unsigned long long)ix.hdr->records,
+	       (unsigned long long)ix.hdr->main,
+	       (unsigned long long)ix.hdr->delta);
+
+	if (query) {
+		record_index_range(&cur, &ix, lo, hi);
+		while (record_index_next(&cur, &rec)) {
+			/* Positions past the data are never handed out */
+			num = record_map_get(&m, rec);
+			if (!num)
+				continue;
+			if (!count_only && matches < PRINT_MAX) {
+				printf("[%llu] n1: %d\tn2: %d\tn3: %d\n",
+				       (unsigned long long)rec,
+				       num->n1, num->n2, num->n3);
+			}
+			matches++;
+		}
+		printf("%llu matches\n", (unsigned long long)matches);
+	}
+
+	record_index_close(&ix);
+	record_map_close(&m);
+	return 0;
+}
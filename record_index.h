@@ -0,0 +1,556 @@
+#ifndef RECORD_INDEX_H
+#define RECORD_INDEX_H
+
+/*
+ * Secondary index on one field of a struct threeNum record file.
+ *
+ * The index maps a field value to the numbers of the records holding it,
+ * so point and range lookups take O(log n) probes instead of a scan of
+ * the whole file. It is its own file, mapped read only:
+ *
+ *	struct index_header	64 bytes
+ *	int32_t  key[main + 1]	main run, Eytzinger order, key[0] unused
+ *	uint64_t rec[main + 1]	record numbers, same order
+ *	int32_t  key[delta]	delta run, sorted
+ *	uint64_t rec[delta]
+ *
+ * The main run is laid out as an implicit binary search tree (Eytzinger
+ * order: the children of slot k are 2k and 2k + 1), so the first levels
+ * of every search share a few cache lines, and the slots four levels
+ * down are contiguous and prefetched before they are needed.
+ *
+ * Records appended to the data file later are indexed incrementally:
+ * record_index_update() reads only the records past the ones already
+ * covered and merges them into the small sorted delta run at the end of
+ * the index, leaving the main run alone. Lookups search both runs. Once
+ * the delta grows past 1/8 of the main run, the whole index is rebuilt.
+ *
+ * Builds and updates write a new index file next to the old one, fsync
+ * it and rename() it into place, so a crash leaves either index whole.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "threenum.h"
+#include "record_reader.h"
+
+#define INDEX_MAGIC	"TNINDEX"
+#define INDEX_VERSION	1
+#define INDEX_FIELDS	3	/* n1, n2, n3 */
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t field;		/* 0 n1, 1 n2, 2 n3 */
+	uint64_t records;	/* Data records covered */
+	uint64_t main;		/* Entries in the main run */
+	uint64_t delta;		/* Entries in the delta run */
+	uint64_t reserved[3];
+};
+
+struct index_entry {
+	int32_t key;
+	uint64_t rec;
+};
+
+struct record_index {
+	const char *base;
+	size_t len;
+	const struct index_header *hdr;
+	const int32_t *main_key;
+	const uint64_t *main_rec;
+	const int32_t *delta_key;
+	const uint64_t *delta_rec;
+};
+
+/* Cursor over the entries with lo <= key <= hi, in key order */
+struct index_cursor {
+	const struct record_index *ix;
+	uint64_t m;		/* Eytzinger slot, 0 at the end */
+	uint64_t d;		/* Delta position */
+	int32_t hi;
+};
+
+static inline int32_t index_key(const struct threeNum *num, int field)
+{
+	return field == 0 ? num->n1 : field == 1 ? num->n2 : num->n3;
+}
+
+static inline size_t index_run_size(uint64_t n)
+{
+	/* Keys padded so the record numbers stay 8 byte aligned */
+	return ((n * sizeof(int32_t) + 7) & ~(size_t)7) + n * sizeof(uint64_t);
+}
+
+static inline size_t index_delta_offset(const struct index_header *hdr)
+{
+	return sizeof(*hdr) + index_run_size(hdr->main + 1);
+}
+
+static inline int index_entry_cmp(const void *a, const void *b)
+{
+	const struct index_entry *x = a, *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->rec < y->rec ? -1 : x->rec > y->rec;
+}
+
+/* Sort, skipping the O(n log n) work for the common already sorted case */
+static inline void index_sort(struct index_entry *e, size_t n)
+{
+	size_t i;
+
+	for (i = 1; i < n; i++)
+		if (index_entry_cmp(&e[i - 1], &e[i]) > 0)
+			break;
+	if (i < n)
+		qsort(e, n, sizeof(*e), index_entry_cmp);
+}
+
+/* Entries of records [from, m->count) */
+static inline struct index_entry *index_collect(const struct record_map *m,
+						int field, uint64_t from)
+{
+	struct index_entry *e;
+	uint64_t i;
+
+	e = malloc((m->count - from + 1) * sizeof(*e));
+	if (!e)
+		return NULL;
+
+	for (i = from; i < m->count; i++) {
+		e[i - from].key = index_key(record_map_get(m, i), field);
+		e[i - from].rec = i;
+	}
+
+	return e;
+}
+
+/*
+ * In order walk of the implicit tree, slots 1..n, handing out the
+ * sorted entries one by one.
+ */
+static inline void index_eytzinger(const struct index_entry *sorted,
+				   uint64_t n, int32_t *key, uint64_t *rec)
+{
+	uint64_t k = 1, i = 0;
+
+	if (!n)
+		return;
+
+	/* Leftmost slot */
+	while (2 * k <= n)
+		k *= 2;
+
+	for (;;) {
+		key[k] = sorted[i].key;
+		rec[k] = sorted[i].rec;
+		if (++i == n)
+			break;
+
+		/* Successor: leftmost of the right subtree, else go up */
+		if (2 * k + 1 <= n) {
+			k = 2 * k + 1;
+			while (2 * k <= n)
+				k *= 2;
+		} else {
+			k >>= __builtin_ffsll(~k);
+		}
+	}
+}
+
+static inline int index_write_full(int fd, const void *buf, size_t len,
+				   off_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Write n entries as a key array followed by a record number array */
+static inline int index_write_run(int fd, const int32_t *key,
+				  const uint64_t *rec, uint64_t n, off_t off)
+{
+	size_t klen = (n * sizeof(int32_t) + 7) & ~(size_t)7;
+	static const char pad[8];
+
+	if (index_write_full(fd, key, n * sizeof(int32_t), off) ||
+	    index_write_full(fd, pad, klen - n * sizeof(int32_t),
+			     off + n * sizeof(int32_t)) ||
+	    index_write_full(fd, rec, n * sizeof(uint64_t), off + klen))
+		return -1;
+
+	return 0;
+}
+
+/* New index file next to path, to be installed by index_install() */
+static inline int index_create(const char *path, char *tmp, size_t len)
+{
+	snprintf(tmp, len, "%s.%d.tmp", path, (int)getpid());
+	return open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+/* Make the rename of a file in path's directory durable */
+static inline int index_sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int fd, ret;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Replace path with the fully written tmp, or drop tmp if ok is 0. Data
+ * goes to disk before the rename and the rename before we return.
+ */
+static inline int index_install(int fd, const char *tmp, const char *path,
+				int ok)
+{
+	if (ok && fsync(fd))
+		ok = 0;
+	if (close(fd))
+		ok = 0;
+	if (!ok || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return index_sync_dir(path);
+}
+
+/* Write sorted entries as a delta run at off and truncate after it */
+static inline int index_write_delta(int fd, const struct index_entry *e,
+				    uint64_t n, off_t off)
+{
+	int32_t *key = malloc(n * sizeof(*key) + 1);
+	uint64_t *rec = malloc(n * sizeof(*rec) + 1);
+	uint64_t i;
+	int ret = -1;
+
+	if (key && rec) {
+		for (i = 0; i < n; i++) {
+			key[i] = e[i].key;
+			rec[i] = e[i].rec;
+		}
+		if (!index_write_run(fd, key, rec, n, off) &&
+		    !ftruncate(fd, off + index_run_size(n)))
+			ret = 0;
+	}
+
+	free(key);
+	free(rec);
+	return ret;
+}
+
+/**
+ * record_index_build: index one field of every record.
+ * @m: mapped data file
+ * @field: 0 n1, 1 n2, 2 n3
+ * @path: index file, replaced
+ */
+static inline int record_index_build(const struct record_map *m, int field,
+				     const char *path)
+{
+	struct index_header hdr;
+	struct index_entry *e;
+	int32_t *key = NULL;
+	uint64_t *rec = NULL;
+	char tmp[PATH_MAX];
+	int fd, ret = -1;
+
+	if (field < 0 || field >= INDEX_FIELDS ||
+	    m->rec_size != sizeof(struct threeNum)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	e = index_collect(m, field, 0);
+	if (!e)
+		return -1;
+	index_sort(e, m->count);
+
+	key = calloc(m->count + 1, sizeof(*key));
+	rec = calloc(m->count + 1, sizeof(*rec));
+	if (!key || !rec)
+		goto out;
+	index_eytzinger(e, m->count, key, rec);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	hdr.version = INDEX_VERSION;
+	hdr.field = field;
+	hdr.records = m->count;
+	hdr.main = m->count;
+
+	fd = index_create(path, tmp, sizeof(tmp));
+	if (fd < 0)
+		goto out;
+	ret = index_install(fd, tmp, path,
+			    !index_write_full(fd, &hdr, sizeof(hdr), 0) &&
+			    !index_write_run(fd, key, rec, m->count + 1,
+					     sizeof(hdr)));
+
+out:
+	free(e);
+	free(key);
+	free(rec);
+	return ret;
+}
+
+/**
+ * record_index_open: map an index file.
+ * @ix: returns the index
+ * @path: index file
+ */
+static inline int record_index_open(struct record_index *ix, const char *path)
+{
+	const struct index_header *hdr;
+	struct stat st;
+	size_t doff;
+	void *base;
+	int fd;
+
+	memset(ix, 0, sizeof(*ix));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	ix->base = base;
+	ix->len = st.st_size;
+	hdr = ix->hdr = base;
+
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+	    hdr->version != INDEX_VERSION || hdr->field >= INDEX_FIELDS ||
+	    index_delta_offset(hdr) + index_run_size(hdr->delta) != ix->len) {
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	ix->main_key = (const int32_t *)(ix->base + sizeof(*hdr));
+	ix->main_rec = (const uint64_t *)(ix->base + sizeof(*hdr) +
+		index_run_size(hdr->main + 1) - (hdr->main + 1) * sizeof(uint64_t));
+	doff = index_delta_offset(hdr);
+	ix->delta_key = (const int32_t *)(ix->base + doff);
+	ix->delta_rec = (const uint64_t *)(ix->base + doff +
+		index_run_size(hdr->delta) - hdr->delta * sizeof(uint64_t));
+
+	return 0;
+}
+
+static inline void record_index_close(struct record_index *ix)
+{
+	if (ix->base)
+		munmap((void *)ix->base, ix->len);
+	ix->base = NULL;
+}
+
+/**
+ * record_index_update: index the records appended since the last update.
+ * @m: mapped data file, the one the index was built from
+ * @path: index file
+ *
+ * Only records past the ones the index covers are read. The main run is
+ * copied over as it is; the new entries are merged into the delta run, or
+ * the index is rebuilt when the delta gets too big.
+ */
+static inline int record_index_update(const struct record_map *m,
+				      const char *path)
+{
+	struct record_index ix;
+	struct index_header hdr;
+	struct index_entry *e, *grown;
+	uint64_t added, n, i;
+	char tmp[PATH_MAX];
+	int fd, ret = -1;
+
+	if (record_index_open(&ix, path))
+		return -1;
+	hdr = *ix.hdr;
+
+	if (m->count < hdr.records) {
+		/* Data file rewritten, not appended to */
+		record_index_close(&ix);
+		return record_index_build(m, hdr.field, path);
+	}
+	added = m->count - hdr.records;
+	if (!added) {
+		record_index_close(&ix);
+		return 0;
+	}
+	if ((hdr.delta + added) * 8 > hdr.main) {
+		record_index_close(&ix);
+		return record_index_build(m, hdr.field, path);
+	}
+
+	e = index_collect(m, hdr.field, hdr.records);
+	if (!e) {
+		record_index_close(&ix);
+		return -1;
+	}
+	grown = realloc(e, (hdr.delta + added) * sizeof(*e));
+	if (!grown)
+		goto out;
+	e = grown;
+	for (i = 0; i < hdr.delta; i++) {
+		e[added + i].key = ix.delta_key[i];
+		e[added + i].rec = ix.delta_rec[i];
+	}
+
+	n = hdr.delta + added;
+	index_sort(e, n);
+
+	fd = index_create(path, tmp, sizeof(tmp));
+	if (fd < 0)
+		goto out;
+	hdr.records = m->count;
+	hdr.delta = n;
+	ret = index_install(fd, tmp, path,
+			    !index_write_full(fd, ix.base + sizeof(hdr),
+					      index_run_size(hdr.main + 1),
+					      sizeof(hdr)) &&
+			    !index_write_delta(fd, e, n,
+					       index_delta_offset(&hdr)) &&
+			    !index_write_full(fd, &hdr, sizeof(hdr), 0));
+
+out:
+	record_index_close(&ix);
+	free(e);
+	return ret;
+}
+
+/* First Eytzinger slot with key >= x, 0 if none */
+static inline uint64_t index_main_lower_bound(const struct record_index *ix,
+					      int32_t x)
+{
+	const int32_t *key = ix->main_key;
+	uint64_t n = ix->hdr->main, k = 1;
+
+	while (k <= n) {
+		/* 16 keys, the descendants four levels down, share a line */
+		__builtin_prefetch(key + 16 * k);
+		k = 2 * k + (key[k] < x);
+	}
+
+	return k >> __builtin_ffsll(~k);
+}
+
+/* In order successor of Eytzinger slot k, 0 at the end */
+static inline uint64_t index_main_next(const struct record_index *ix,
+				       uint64_t k)
+{
+	uint64_t n = ix->hdr->main;
+
+	if (2 * k + 1 <= n) {
+		k = 2 * k + 1;
+		while (2 * k <= n)
+			k *= 2;
+		return k;
+	}
+
+	return k >> __builtin_ffsll(~k);
+}
+
+static inline uint64_t index_delta_lower_bound(const struct record_index *ix,
+					       int32_t x)
+{
+	uint64_t lo = 0, hi = ix->hdr->delta, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ix->delta_key[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Start a cursor over the entries with lo <= key <= hi */
+static inline void record_index_range(struct index_cursor *c,
+				      const struct record_index *ix,
+				      int32_t lo, int32_t hi)
+{
+	c->ix = ix;
+	c->hi = hi;
+	c->m = index_main_lower_bound(ix, lo);
+	c->d = index_delta_lower_bound(ix, lo);
+}
+
+/* Next matching record number into *rec, 0 when there are no more */
+static inline int record_index_next(struct index_cursor *c, uint64_t *rec)
+{
+	const struct record_index *ix = c->ix;
+	int mvalid, dvalid;
+
+	mvalid = c->m && ix->main_key[c->m] <= c->hi;
+	dvalid = c->d < ix->hdr->delta && ix->delta_key[c->d] <= c->hi;
+
+	if (mvalid && (!dvalid || ix->main_key[c->m] <= ix->delta_key[c->d])) {
+		*rec = ix->main_rec[c->m];
+		c->m = index_main_next(ix, c->m);
+		return 1;
+	}
+	if (dvalid) {
+		*rec = ix->delta_rec[c->d++];
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif /* RECORD_INDEX_H */
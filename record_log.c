@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "threenum.h"
+#include "record_log.h"
+
+/*
+ * Appends struct threeNum records to a log from several threads, each
+ * commit waiting for durability, and reports how many records every
+ * fdatasync() covered.
+ *
+ *	-p <threads>	producers, default 4
+ *	-n <records>	records per producer, default 1000
+ *	-f <file>	log file, default program.log
+ *	-a		don't wait per record, only once at the end
+ *
+ * gcc record_log.c -lpthread -o record_log
+ */
+struct producer {
+	struct record_log *log;
+	int first, count, async;
+	int failed;
+};
+
+static void *produce(void *arg)
+{
+	struct producer *p = arg;
+	struct threeNum num;
+	uint64_t seq = 0;
+	int n;
+
+	for (n = p->first; n < p->first + p->count; n++) {
+		threenum_fill(&num, n);
+		seq = record_log_append(p->log, &num);
+		if (!p->async && record_log_wait(p->log, seq)) {
+			p->failed = 1;
+			return NULL;
+		}
+	}
+	if (p->async && p->count && record_log_wait(p->log, seq))
+		p->failed = 1;
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "program.log";
+	int threads = 4, count = 1000, async = 0;
+	struct record_log log;
+	struct producer *p;
+	pthread_t *tid;
+	int c, t, ret = 0;
+
+	while ((c = getopt(argc, argv, "p:n:f:a")) != -1)
+		switch (c) {
+		case 'p':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'a':
+			async = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p threads] [-n records] "
+				"[-f file] [-a]\n", argv[0]);
+			return 1;
+		}
+
+	if (threads < 1 || count < 0) {
+		fprintf(stderr, "Invalid -p or -n\n");
+		return 1;
+	}
+
+	p = calloc(threads, sizeof(*p));
+	tid = calloc(threads, sizeof(*tid));
+	if (!p || !tid) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (record_log_open(&log, path, sizeof(struct threeNum), 0)) {
+		perror(path);
+		return 1;
+	}
+
+	for (t = 0; t < threads; t++) {
+		p[t].log = &log;
+		p[t].first = t * count + 1;
+		p[t].count = count;
+		p[t].async = async;
+		pthread_create(&tid[t], NULL, produce, &p[t]);
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join(tid[t], NULL);
+		if (p[t].failed)
+			ret = 1;
+	}
+
+	record_log_stats(&log, stdout);
+	if (record_log_close(&log) || ret) {
+		perror(path);
+		ret = 1;
+	}
+
+	free(p);
+	free(tid);
+	return ret;
+}
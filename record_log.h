@@ -0,0 +1,339 @@
+#ifndef RECORD_LOG_H
+#define RECORD_LOG_H
+
+/*
+ * Append-only record log with group commit.
+ *
+ * Producers reserve the next record slot with one atomic fetch-add on the
+ * tail, copy their record into a shared ring and mark the slot ready; no
+ * lock is taken on the append path. A single flusher thread collects the
+ * contiguous run of ready records, writes it with one pwritev() and makes
+ * it durable with one fdatasync(), so however many producers commit
+ * concurrently the log pays one sync per batch instead of one per record.
+ *
+ * Every record gets a sequence number, its 1-based position among the
+ * records appended since the log was opened. A producer that needs
+ * durability waits until the durable sequence number reaches its own:
+ *
+ *	seq = record_log_append(&log, &rec);
+ *	...
+ *	record_log_wait(&log, seq);
+ *
+ * or record_log_commit() for both. Records nobody waits for are still
+ * synced within RECORD_LOG_LINGER_US.
+ *
+ *	gcc record_log.c -lpthread
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define RECORD_LOG_SLOTS	(1 << 16)
+#define RECORD_LOG_LINGER_US	1000
+
+struct record_log {
+	int fd;
+	size_t rec_size;
+	size_t nslots;		/* Ring capacity in records */
+	char *ring;
+	uint64_t *ready;	/* Sequence number stored in each slot */
+	off_t base;		/* File offset of sequence number 1 */
+
+	uint64_t tail;		/* Slots reserved, fetch-add */
+	uint64_t written;	/* Slots handed to the kernel, ring reusable */
+	uint64_t durable;	/* Slots fdatasync()ed */
+	int error;		/* errno of a failed write or sync */
+	int closing;
+
+	pthread_t flusher;
+	pthread_mutex_t lock;
+	pthread_cond_t kick;	/* Wakes the flusher */
+	pthread_cond_t done;	/* Wakes producers on progress */
+
+	uint64_t batches;
+	uint64_t max_batch;
+	struct timespec start;
+};
+
+static inline void record_log_deadline(struct timespec *ts, long us)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_nsec += us * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Write [from, to) from the ring, in two pieces when it wraps */
+static inline int record_log_write(struct record_log *log, uint64_t from,
+				   uint64_t to)
+{
+	struct iovec iov[2];
+	size_t first = from % log->nslots;
+	size_t n = to - from, len;
+	off_t off = log->base + from * log->rec_size;
+	ssize_t ret;
+	int iovcnt = 1;
+
+	iov[0].iov_base = log->ring + first * log->rec_size;
+	if (first + n > log->nslots) {
+		iov[0].iov_len = (log->nslots - first) * log->rec_size;
+		iov[1].iov_base = log->ring;
+		iov[1].iov_len = (first + n - log->nslots) * log->rec_size;
+		iovcnt = 2;
+	} else {
+		iov[0].iov_len = n * log->rec_size;
+	}
+
+	len = n * log->rec_size;
+	while (len) {
+		ret = pwritev(log->fd, iov, iovcnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		len -= ret;
+		off += ret;
+		while (iovcnt && (size_t)ret >= iov[0].iov_len) {
+			ret -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov[0].iov_base = (char *)iov[0].iov_base + ret;
+			iov[0].iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static inline void *record_log_flusher(void *arg)
+{
+	struct record_log *log = arg;
+	struct timespec ts;
+	uint64_t next = 0, end;
+
+	for (;;) {
+		/* Longest run of published records */
+		end = next;
+		while (end - next < log->nslots &&
+		       __atomic_load_n(&log->ready[end % log->nslots],
+				       __ATOMIC_ACQUIRE) == end + 1)
+			end++;
+
+		if (end == next) {
+			pthread_mutex_lock(&log->lock);
+			if (log->closing &&
+			    __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) == next) {
+				pthread_mutex_unlock(&log->lock);
+				break;
+			}
+			record_log_deadline(&ts, RECORD_LOG_LINGER_US);
+			pthread_cond_timedwait(&log->kick, &log->lock, &ts);
+			pthread_mutex_unlock(&log->lock);
+			continue;
+		}
+
+		if (record_log_write(log, next, end)) {
+			log->error = errno;
+		} else {
+			/* Ring space is free once the kernel has the data */
+			__atomic_store_n(&log->written, end, __ATOMIC_RELEASE);
+			if (fdatasync(log->fd))
+				log->error = errno;
+		}
+
+		pthread_mutex_lock(&log->lock);
+		if (!log->error)
+			__atomic_store_n(&log->durable, end, __ATOMIC_RELEASE);
+		log->batches++;
+		if (end - next > log->max_batch)
+			log->max_batch = end - next;
+		pthread_cond_broadcast(&log->done);
+		pthread_mutex_unlock(&log->lock);
+
+		if (log->error)
+			break;
+		next = end;
+	}
+
+	return NULL;
+}
+
+/**
+ * record_log_open: open a log for appending, creating it if needed.
+ * @log: log
+ * @path: file
+ * @rec_size: size of one record
+ * @nslots: records buffered in memory, 0 for RECORD_LOG_SLOTS
+ *
+ * Records already in the file are kept; new ones go after them.
+ */
+static inline int record_log_open(struct record_log *log, const char *path,
+				  size_t rec_size, size_t nslots)
+{
+	struct stat st;
+
+	memset(log, 0, sizeof(*log));
+	log->rec_size = rec_size;
+	log->nslots = nslots ? nslots : RECORD_LOG_SLOTS;
+
+	log->fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (log->fd < 0)
+		return -1;
+	if (fstat(log->fd, &st))
+		goto err_close;
+	if (st.st_size % rec_size) {
+		/* Torn last record from a crash, drop it */
+		if (ftruncate(log->fd, st.st_size - st.st_size % rec_size))
+			goto err_close;
+	}
+	log->base = st.st_size - st.st_size % rec_size;
+
+	log->ring = malloc(log->nslots * rec_size);
+	log->ready = calloc(log->nslots, sizeof(*log->ready));
+	if (!log->ring || !log->ready)
+		goto err_free;
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->kick, NULL);
+	pthread_cond_init(&log->done, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &log->start);
+
+	errno = pthread_create(&log->flusher, NULL, record_log_flusher, log);
+	if (errno)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	free(log->ring);
+	free(log->ready);
+err_close:
+	close(log->fd);
+	return -1;
+}
+
+/**
+ * record_log_append: add a record to the log.
+ * @log: log
+ * @rec: record, rec_size bytes
+ *
+ * Returns the record's sequence number, or 0 if the log failed. Only
+ * blocks when the ring is full of records not yet written.
+ */
+static inline uint64_t record_log_append(struct record_log *log,
+					 const void *rec)
+{
+	uint64_t i;
+
+	i = __atomic_fetch_add(&log->tail, 1, __ATOMIC_ACQ_REL);
+
+	if (i - __atomic_load_n(&log->written, __ATOMIC_ACQUIRE) >= log->nslots) {
+		pthread_mutex_lock(&log->lock);
+		while (!log->error &&
+		       i - __atomic_load_n(&log->written, __ATOMIC_ACQUIRE) >=
+		       log->nslots) {
+			pthread_cond_signal(&log->kick);
+			pthread_cond_wait(&log->done, &log->lock);
+		}
+		pthread_mutex_unlock(&log->lock);
+		if (log->error)
+			return 0;
+	}
+
+	memcpy(log->ring + (i % log->nslots) * log->rec_size, rec,
+	       log->rec_size);
+	__atomic_store_n(&log->ready[i % log->nslots], i + 1, __ATOMIC_RELEASE);
+
+	return i + 1;
+}
+
+/* Wait until record seq is on stable storage */
+static inline int record_log_wait(struct record_log *log, uint64_t seq)
+{
+	if (!seq)
+		return -1;
+	if (__atomic_load_n(&log->durable, __ATOMIC_ACQUIRE) >= seq)
+		return 0;
+
+	pthread_mutex_lock(&log->lock);
+	pthread_cond_signal(&log->kick);
+	while (!log->error &&
+	       __atomic_load_n(&log->durable, __ATOMIC_ACQUIRE) < seq)
+		pthread_cond_wait(&log->done, &log->lock);
+	pthread_mutex_unlock(&log->lock);
+
+	if (__atomic_load_n(&log->durable, __ATOMIC_ACQUIRE) < seq) {
+		errno = log->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Append a record and wait for it to be durable */
+static inline int record_log_commit(struct record_log *log, const void *rec)
+{
+	return record_log_wait(log, record_log_append(log, rec));
+}
+
+/* Sync whatever was appended and stop the flusher. No appends may race it */
+static inline int record_log_close(struct record_log *log)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&log->lock);
+	log->closing = 1;
+	pthread_cond_signal(&log->kick);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->flusher, NULL);
+
+	if (log->error) {
+		errno = log->error;
+		ret = -1;
+	}
+	if (close(log->fd))
+		ret = -1;
+
+	free(log->ring);
+	free(log->ready);
+	pthread_mutex_destroy(&log->lock);
+	pthread_cond_destroy(&log->kick);
+	pthread_cond_destroy(&log->done);
+
+	return ret;
+}
+
+static inline void record_log_stats(struct record_log *log, FILE *out)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - log->start.tv_sec) +
+	       (now.tv_nsec - log->start.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	fprintf(out, "%llu records in %llu syncs (avg %.1f, max %llu per "
+		"batch), %.3fs: %.0f records/s\n",
+		(unsigned long long)log->durable,
+		(unsigned long long)log->batches,
+		log->batches ? (double)log->durable / log->batches : 0.0,
+		(unsigned long long)log->max_batch, secs,
+		log->durable / secs);
+}
+
+#endif /* RECORD_LOG_H */
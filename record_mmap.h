@@ -0,0 +1,330 @@
+#ifndef RECORD_MMAP_H
+#define RECORD_MMAP_H
+
+/*
+ * Mapped record appender.
+ *
+ * Records are written straight into a shared mapping of the file, with
+ * no stdio or writer buffer in between and no write() copying them into
+ * the page cache afterwards: the mapping is the page cache. The file is
+ * a record_file.h file and grows in extents of RECORD_MMAP_EXTENT bytes,
+ * preallocated with fallocate() so the filesystem hands out large
+ * contiguous runs and page faults on the new pages never have to
+ * allocate blocks or fail with SIGBUS on a full disk; the mapping is
+ * extended with mremap() to match.
+ *
+ * While the file is open its header carries RECORD_FILE_LIVE and the
+ * committed record count, stored by record_appender_commit() after the
+ * records it covers, so a reader mapping the file (record_file_map())
+ * sees a consistent prefix. On close the block checksums go in after
+ * the records, the header becomes a plain record_file.h one and the
+ * file is cut to its exact size:
+ *
+ *	record_appender_open(&a, "program.bin", sizeof(*num),
+ *			     THREENUM_SCHEMA, 0);
+ *	num = record_appender_reserve(&a, 1);
+ *	threenum_fill(num, n);
+ *	record_appender_advance(&a, 1);
+ *	...
+ *	record_appender_commit(&a, 0);		every so many records
+ *	...
+ *	record_appender_close(&a);
+ *
+ * Pointers from record_appender_reserve() are valid until the next
+ * reserve or append, which may move the mapping.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "record_file.h"
+
+#define RECORD_MMAP_EXTENT	(64 << 20)
+
+struct record_appender {
+	int fd;
+	char *map;		/* Whole file, header first */
+	size_t map_len;		/* Bytes allocated and mapped */
+	size_t extent;
+	size_t rec_size;
+	size_t used;		/* Header and records written */
+	size_t synced;		/* Bytes up to which the file was msync()ed */
+	uint64_t count;		/* Records written, committed or not */
+
+	/* Block checksums, as record_file_writer keeps them */
+	uint32_t crc;
+	uint32_t in_block;
+	size_t crc_from;	/* Start of the unchecksummed records */
+	uint32_t *crcs;
+	size_t ncrcs, crcs_alloc;
+
+	uint64_t grows;
+	uint64_t commits;
+	struct timespec start;
+};
+
+static inline struct record_file_header *
+record_appender_header(struct record_appender *a)
+{
+	return (struct record_file_header *)a->map;
+}
+
+/* Allocate [from, to) of the file, extending it */
+static inline int rm_allocate(int fd, size_t from, size_t to)
+{
+	if (!fallocate(fd, 0, from, to - from))
+		return 0;
+	/* No fallocate() on this filesystem, a sparse file will do */
+	if (errno == EOPNOTSUPP || errno == ENOSYS)
+		return ftruncate(fd, to);
+
+	return -1;
+}
+
+/* Make room for need bytes in all, in whole extents */
+static inline int rm_grow(struct record_appender *a, size_t need)
+{
+	size_t len = (need + a->extent - 1) / a->extent * a->extent;
+	void *map;
+
+	if (rm_allocate(a->fd, a->map_len, len))
+		return -1;
+
+	map = mremap(a->map, a->map_len, len, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
+		return -1;
+
+	a->map = map;
+	a->map_len = len;
+	a->grows++;
+
+	return 0;
+}
+
+/**
+ * record_appender_open: create a record file to append to in place.
+ * @a: appender
+ * @path: file, truncated
+ * @rec_size: size of one record
+ * @schema: schema string stored in the header, checked by readers
+ * @extent: growth step in bytes, 0 for RECORD_MMAP_EXTENT
+ */
+static inline int record_appender_open(struct record_appender *a,
+				       const char *path, size_t rec_size,
+				       const char *schema, size_t extent)
+{
+	struct record_file_header *hdr;
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	memset(a, 0, sizeof(*a));
+
+	if (!rec_size || strlen(schema) >= sizeof(hdr->schema)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	a->extent = extent ? extent : RECORD_MMAP_EXTENT;
+	a->extent = (a->extent + page - 1) / page * page;
+	a->rec_size = rec_size;
+
+	a->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (a->fd < 0)
+		return -1;
+
+	if (rm_allocate(a->fd, 0, a->extent))
+		goto err;
+	a->map = mmap(NULL, a->extent, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      a->fd, 0);
+	if (a->map == MAP_FAILED)
+		goto err;
+	a->map_len = a->extent;
+
+	hdr = record_appender_header(a);
+	memcpy(hdr->magic, RECORD_FILE_MAGIC, sizeof(RECORD_FILE_MAGIC));
+	hdr->endian = RECORD_FILE_ENDIAN;
+	hdr->version = RECORD_FILE_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->rec_size = rec_size;
+	hdr->block_records = RECORD_FILE_BLOCK_BYTES / rec_size ?
+			     RECORD_FILE_BLOCK_BYTES / rec_size : 1;
+	strcpy(hdr->schema, schema);
+	hdr->flags = RECORD_FILE_LIVE;
+	hdr->header_crc = record_file_header_crc(*hdr);
+
+	a->used = a->crc_from = sizeof(*hdr);
+	clock_gettime(CLOCK_MONOTONIC, &a->start);
+
+	return 0;
+
+err:
+	close(a->fd);
+	unlink(path);
+	return -1;
+}
+
+/**
+ * record_appender_reserve: room for n records at the end of the file.
+ * @a: appender
+ * @n: records
+ *
+ * Returns where to build them in the mapping, or NULL with errno set if
+ * the file can't grow. They count once record_appender_advance() says
+ * so; reserving again without advancing hands out the same room.
+ */
+static inline void *record_appender_reserve(struct record_appender *a,
+					    size_t n)
+{
+	size_t need = a->used + n * a->rec_size;
+
+	if (need > a->map_len && rm_grow(a, need))
+		return NULL;
+
+	return a->map + a->used;
+}
+
+/* The first n reserved records are written */
+static inline void record_appender_advance(struct record_appender *a,
+					   size_t n)
+{
+	a->used += n * a->rec_size;
+	a->count += n;
+}
+
+static inline int record_appender_append(struct record_appender *a,
+					 const void *rec)
+{
+	void *p = record_appender_reserve(a, 1);
+
+	if (!p)
+		return -1;
+	memcpy(p, rec, a->rec_size);
+	record_appender_advance(a, 1);
+
+	return 0;
+}
+
+/* Checksum the records written since the last call, block by block */
+static inline int rm_crc_pending(struct record_appender *a, int end)
+{
+	uint32_t block = record_appender_header(a)->block_records, n;
+	uint32_t *tmp;
+
+	while (a->crc_from < a->used || (end && a->in_block)) {
+		n = (a->used - a->crc_from) / a->rec_size;
+		if (n > block - a->in_block)
+			n = block - a->in_block;
+		a->crc = crc32c(a->crc, a->map + a->crc_from, n * a->rec_size);
+		a->crc_from += n * a->rec_size;
+		a->in_block += n;
+
+		if (a->in_block < block && (!end || a->crc_from < a->used))
+			continue;
+
+		if (a->ncrcs == a->crcs_alloc) {
+			a->crcs_alloc = a->crcs_alloc ? 2 * a->crcs_alloc : 64;
+			tmp = realloc(a->crcs, a->crcs_alloc * sizeof(*tmp));
+			if (!tmp)
+				return -1;
+			a->crcs = tmp;
+		}
+		a->crcs[a->ncrcs++] = a->crc;
+		a->crc = 0;
+		a->in_block = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * record_appender_commit: publish the records written so far.
+ * @a: appender
+ * @sync: msync() the records, then the header, before returning
+ *
+ * Readers see the new count only after the records it covers; with
+ * @sync they are also on disk in that order.
+ */
+static inline int record_appender_commit(struct record_appender *a, int sync)
+{
+	struct record_file_header *hdr = record_appender_header(a);
+	size_t page = sysconf(_SC_PAGESIZE), from;
+
+	if (rm_crc_pending(a, 0))
+		return -1;
+
+	if (sync && a->used > a->synced) {
+		from = a->synced / page * page;
+		if (msync(a->map + from, a->used - from, MS_SYNC))
+			return -1;
+		a->synced = a->used;
+	}
+
+	__atomic_store_n(&hdr->count, a->count, __ATOMIC_RELEASE);
+	a->commits++;
+
+	if (sync && msync(a->map, page, MS_SYNC))
+		return -1;
+
+	return 0;
+}
+
+/* Write the checksums, finalize the header and cut the file to size */
+static inline int record_appender_close(struct record_appender *a)
+{
+	struct record_file_header *hdr;
+	size_t crc_len = 0;
+	int ret = -1;
+
+	if (rm_crc_pending(a, 1))
+		goto out;
+
+	crc_len = a->ncrcs * sizeof(*a->crcs);
+	if (a->used + crc_len > a->map_len && rm_grow(a, a->used + crc_len))
+		goto out;
+	memcpy(a->map + a->used, a->crcs, crc_len);
+
+	hdr = record_appender_header(a);
+	hdr->count = a->count;
+	hdr->flags &= ~RECORD_FILE_LIVE;
+	hdr->header_crc = record_file_header_crc(*hdr);
+	ret = 0;
+
+out:
+	if (munmap(a->map, a->map_len))
+		ret = -1;
+	/* Gives back what's left of the last extent */
+	if (!ret && ftruncate(a->fd, a->used + crc_len))
+		ret = -1;
+	if (close(a->fd))
+		ret = -1;
+	free(a->crcs);
+	a->crcs = NULL;
+
+	return ret;
+}
+
+static inline void record_appender_stats(struct record_appender *a, FILE *out)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - a->start.tv_sec +
+	       (now.tv_nsec - a->start.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	fprintf(out, "%llu records, %llu bytes in %llu remaps, "
+		"%llu commits, %.3fs: %.0f records/s, %.1f MB/s\n",
+		(unsigned long long)a->count, (unsigned long long)a->used,
+		(unsigned long long)a->grows,
+		(unsigned long long)a->commits, secs, a->count / secs,
+		a->used / secs / 1e6);
+}
+
+#endif /* RECORD_MMAP_H */
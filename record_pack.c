@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threenum.h"
+#include "record_file.h"
+#include "record_schema.h"
+#include "record_pack.h"
+
+/*
+ * Compresses program.bin with record_pack.h and reads it back.
+ *
+ *	record_pack -c		program.bin -> program.tnp
+ *	record_pack -s		sum the fields, with decode speed
+ *	record_pack -x		check program.tnp against program.bin
+ *
+ *	-i <file>	record file instead of program.bin
+ *	-o <file>	packed file instead of program.tnp
+ *
+ * gcc -O2 record_pack.c -o record_pack
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compress(const char *in, const char *out)
+{
+	const struct threeNum *num;
+	struct pack_writer pw;
+	struct record_iter it;
+	struct record_map m;
+	double start = now();
+
+	if (threenum_file_map(&m, in, RECORD_ACCESS_SEQUENTIAL)) {
+		perror(in);
+		return 1;
+	}
+	if (pack_writer_open(&pw, out)) {
+		perror(out);
+		return 1;
+	}
+
+	record_iter_init(&it, &m);
+	while ((num = record_iter_next(&it)) != NULL)
+		if (pack_writer_append(&pw, num)) {
+			perror(out);
+			return 1;
+		}
+
+	if (pack_writer_close(&pw)) {
+		perror(out);
+		return 1;
+	}
+	printf("%s: %zu records in %llu blocks, %llu bytes (%.1fx), %.3fs\n",
+	       out, m.count, (unsigned long long)pw.hdr.nblocks,
+	       (unsigned long long)pw.w.bytes,
+	       pw.w.bytes ? (double)m.count * sizeof(*num) / pw.w.bytes : 0,
+	       now() - start);
+
+	record_map_close(&m);
+	return 0;
+}
+
+static int sum(const char *path)
+{
+	int32_t cols[PACK_FIELDS][PACK_BLOCK_ROWS];
+	long long s1 = 0, s2 = 0, s3 = 0;
+	struct pack_reader pr;
+	unsigned int rows, i;
+	const char *p;
+	double start, secs;
+
+	if (pack_reader_open(&pr, path)) {
+		perror(path);
+		return 1;
+	}
+
+	start = now();
+	for (p = pack_first_block(&pr); p; p = pack_next_block(&pr, p)) {
+		rows = pack_decode_columns(p, cols);
+		for (i = 0; i < rows; i++) {
+			s1 += cols[0][i];
+			s2 += cols[1][i];
+			s3 += cols[2][i];
+		}
+	}
+	secs = now() - start;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s: %llu records, decoded at %.2f GB/s of records\n", path,
+	       (unsigned long long)pr.hdr->count,
+	       pr.hdr->count * sizeof(struct threeNum) / secs / 1e9);
+	printf("sum n1: %lld\tn2: %lld\tn3: %lld\n", s1, s2, s3);
+
+	pack_reader_close(&pr);
+	return 0;
+}
+
+static int check(const char *in, const char *path)
+{
+	struct threeNum out[PACK_BLOCK_ROWS];
+	const struct threeNum *num;
+	struct pack_reader pr;
+	struct record_map m;
+	unsigned int rows, i;
+	size_t n = 0;
+	const char *p;
+
+	if (threenum_file_map(&m, in, RECORD_ACCESS_SEQUENTIAL)) {
+		perror(in);
+		return 1;
+	}
+	if (pack_reader_open(&pr, path)) {
+		perror(path);
+		return 1;
+	}
+
+	for (p = pack_first_block(&pr); p; p = pack_next_block(&pr, p)) {
+		rows = pack_decode_block(p, out);
+		for (i = 0; i < rows; i++, n++) {
+			num = record_map_get(&m, n);
+			if (!num || num->n1 != out[i].n1 ||
+			    num->n2 != out[i].n2 || num->n3 != out[i].n3) {
+				printf("record %zu differs\n", n);
+				return 1;
+			}
+		}
+	}
+	if (n != m.count) {
+		printf("%zu records packed, %zu in %s\n", n, m.count, in);
+		return 1;
+	}
+	printf("%s: %zu records match %s\n", path, n, in);
+
+	pack_reader_close(&pr);
+	record_map_close(&m);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *in = "program.bin", *out = "program.tnp";
+	int c, mode = 0;
+
+	while ((c = getopt(argc, argv, "csxi:o:")) != -1)
+		switch (c) {
+		case 'c':
+		case 's':
+		case 'x':
+			mode = c;
+			break;
+		case 'i':
+			in = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			mode = 0;
+			optind = argc;
+			break;
+		}
+
+	switch (mode) {
+	case 'c':
+		return compress(in, out);
+	case 's':
+		return sum(out);
+	case 'x':
+		return check(in, out);
+	}
+
+	fprintf(stderr, "Usage: %s [-i in] [-o out] -c | -s | -x\n", argv[0]);
+	return 1;
+}
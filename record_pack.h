@@ -0,0 +1,496 @@
+#ifndef RECORD_PACK_H
+#define RECORD_PACK_H
+
+/*
+ * Compressed struct threeNum files.
+ *
+ * Records are packed in blocks of PACK_BLOCK_ROWS. Every field of a
+ * block is encoded on its own, in three steps that each decode with a
+ * few vector instructions:
+ *
+ *	delta		d[i] = x[i] - x[i - 4], the first four against a base,
+ *			so the prefix sum runs four lanes at once
+ *	frame of ref	u[i] = d[i] - min(d), small and non negative
+ *	bit packing	u[] at the width of the largest, 4 lanes interleaved
+ *			(the SIMD-BP128 layout of FastPFor)
+ *
+ * On top of that a block whose rows all have n2 == 5 * n1 and
+ * n3 == n2 + 1, which fwrite.c always writes, stores n1 only and
+ * derives the other two when decoding. Monotonic n1 in steps of one
+ * packs to 3 bits per value, so such a block takes 80 bytes instead of
+ * 1536.
+ *
+ *	struct pack_header		64 bytes
+ *	block: struct pack_block	32 bytes
+ *	       uint32_t n1[4 * width[0]]
+ *	       uint32_t n2[4 * width[1]]	unless PACK_DERIVED
+ *	       uint32_t n3[4 * width[2]]	unless PACK_DERIVED
+ *	block ...
+ *
+ * Uses SSE2, which every x86-64 has, with a scalar fallback producing
+ * the same layout elsewhere.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "threenum.h"
+#include "record_writer.h"
+#include "record_reader.h"
+#include "record_schema.h"
+
+#define PACK_MAGIC	"TNPACKED"
+#define PACK_VERSION	1
+#define PACK_BLOCK_ROWS	128
+#define PACK_LANES	4
+#define PACK_FIELDS	3
+
+#define PACK_DERIVED	0x01	/* n2 = 5 * n1, n3 = n2 + 1 */
+
+struct pack_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_rows;
+	uint64_t count;		/* Records */
+	uint64_t nblocks;
+	uint64_t reserved[4];
+};
+
+struct pack_block {
+	uint16_t rows;
+	uint8_t flags;
+	uint8_t width[PACK_FIELDS];	/* Bits per value */
+	uint16_t reserved;
+	int32_t base[PACK_FIELDS];
+	int32_t min[PACK_FIELDS];	/* Frame of reference of the deltas */
+};
+
+struct pack_writer {
+	struct record_writer w;
+	struct pack_header hdr;
+	uint32_t rows;
+	int32_t col[PACK_FIELDS][PACK_BLOCK_ROWS];
+};
+
+struct pack_reader {
+	struct record_map m;
+	const struct pack_header *hdr;
+	const char *first;	/* First block */
+};
+
+static inline size_t pack_block_size(const struct pack_block *b)
+{
+	size_t words = b->width[0];
+
+	if (!(b->flags & PACK_DERIVED))
+		words += b->width[1] + b->width[2];
+
+	return sizeof(*b) + words * PACK_LANES * sizeof(uint32_t);
+}
+
+/* Header fields the decoder trusts: row count and bit widths */
+static inline int pack_block_valid(const struct pack_block *b)
+{
+	int f;
+
+	if (b->rows > PACK_BLOCK_ROWS)
+		return 0;
+	for (f = 0; f < PACK_FIELDS; f++)
+		if (b->width[f] > 32)
+			return 0;
+
+	return 1;
+}
+
+/* Bits needed for the largest of 128 values */
+static inline unsigned int pack_width(const uint32_t *u)
+{
+	uint32_t all = 0;
+	int i;
+
+	for (i = 0; i < PACK_BLOCK_ROWS; i++)
+		all |= u[i];
+
+	return all ? 32 - __builtin_clz(all) : 0;
+}
+
+/* Pack 128 values at width bits into 4 * width words */
+static inline void pack_bits(const uint32_t *in, unsigned int width,
+			     uint32_t *out)
+{
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128(), v;
+	unsigned int shift = 0;
+	int i;
+
+	if (!width)
+		return;
+
+	for (i = 0; i < PACK_BLOCK_ROWS / PACK_LANES; i++) {
+		v = _mm_loadu_si128((const __m128i *)(in + PACK_LANES * i));
+		acc = _mm_or_si128(acc, _mm_sll_epi32(v,
+					_mm_cvtsi32_si128(shift)));
+		shift += width;
+		if (shift >= 32) {
+			_mm_storeu_si128((__m128i *)out, acc);
+			out += PACK_LANES;
+			shift -= 32;
+			acc = shift ? _mm_srl_epi32(v,
+					_mm_cvtsi32_si128(width - shift)) :
+				      _mm_setzero_si128();
+		}
+	}
+#else
+	unsigned int shift, lane, j;
+	uint32_t acc, v;
+	int i;
+
+	if (!width)
+		return;
+
+	for (lane = 0; lane < PACK_LANES; lane++) {
+		acc = shift = j = 0;
+		for (i = 0; i < PACK_BLOCK_ROWS / PACK_LANES; i++) {
+			v = in[PACK_LANES * i + lane];
+			acc |= v << shift;
+			shift += width;
+			if (shift >= 32) {
+				out[PACK_LANES * j++ + lane] = acc;
+				shift -= 32;
+				acc = shift ? v >> (width - shift) : 0;
+			}
+		}
+	}
+#endif
+}
+
+/*
+ * Unpack 128 values, add the frame of reference and undo the delta
+ * coding, all in one pass.
+ */
+static inline void pack_decode_field(const uint32_t *in, unsigned int width,
+				     int32_t base, int32_t min, int32_t *out)
+{
+#ifdef __SSE2__
+	__m128i mask, minv, prev, w, v;
+	unsigned int shift = 0;
+	int i;
+
+	minv = _mm_set1_epi32(min);
+	prev = _mm_set1_epi32(base);
+
+	if (!width) {
+		for (i = 0; i < PACK_BLOCK_ROWS / PACK_LANES; i++) {
+			prev = _mm_add_epi32(prev, minv);
+			_mm_storeu_si128((__m128i *)out + i, prev);
+		}
+		return;
+	}
+
+	mask = _mm_set1_epi32(width == 32 ? -1 : (int32_t)((1u << width) - 1));
+	w = _mm_loadu_si128((const __m128i *)in);
+	for (i = 0; i < PACK_BLOCK_ROWS / PACK_LANES; i++) {
+		v = _mm_srl_epi32(w, _mm_cvtsi32_si128(shift));
+		shift += width;
+		if (shift >= 32) {
+			shift -= 32;
+			in += PACK_LANES;
+			if (i + 1 < PACK_BLOCK_ROWS / PACK_LANES)
+				w = _mm_loadu_si128((const __m128i *)in);
+			if (shift)
+				v = _mm_or_si128(v, _mm_sll_epi32(w,
+					_mm_cvtsi32_si128(width - shift)));
+		}
+		v = _mm_add_epi32(_mm_and_si128(v, mask), minv);
+		prev = _mm_add_epi32(prev, v);
+		_mm_storeu_si128((__m128i *)out + i, prev);
+	}
+#else
+	uint32_t mask, w, v, prev;
+	unsigned int shift, lane, j;
+	int i;
+
+	mask = width == 32 ? ~0u : (1u << width) - 1;
+	for (lane = 0; lane < PACK_LANES; lane++) {
+		prev = base;
+		shift = j = 0;
+		w = width ? in[lane] : 0;
+		for (i = 0; i < PACK_BLOCK_ROWS / PACK_LANES; i++) {
+			v = width ? w >> shift : 0;
+			shift += width;
+			if (width && shift >= 32) {
+				shift -= 32;
+				if (++j < width)
+					w = in[PACK_LANES * j + lane];
+				if (shift)
+					v |= w << (width - shift);
+			}
+			prev += (v & mask) + (uint32_t)min;
+			out[PACK_LANES * i + lane] = prev;
+		}
+	}
+#endif
+}
+
+/* n2 = 5 * n1, n3 = n2 + 1 for a derived block */
+static inline void pack_derive(const int32_t *n1, int32_t *n2, int32_t *n3)
+{
+#ifdef __SSE2__
+	__m128i a, b, one = _mm_set1_epi32(1);
+	int i;
+
+	for (i = 0; i < PACK_BLOCK_ROWS; i += PACK_LANES) {
+		a = _mm_loadu_si128((const __m128i *)(n1 + i));
+		b = _mm_add_epi32(_mm_slli_epi32(a, 2), a);
+		_mm_storeu_si128((__m128i *)(n2 + i), b);
+		_mm_storeu_si128((__m128i *)(n3 + i), _mm_add_epi32(b, one));
+	}
+#else
+	int i;
+
+	for (i = 0; i < PACK_BLOCK_ROWS; i++) {
+		n2[i] = (int32_t)(5u * (uint32_t)n1[i]);
+		n3[i] = (int32_t)((uint32_t)n2[i] + 1);
+	}
+#endif
+}
+
+/**
+ * pack_decode_columns: decode a block into three column arrays.
+ * @p: block
+ * @cols: PACK_BLOCK_ROWS values per field; rows past the block's own
+ *	are filled with padding
+ *
+ * Returns the number of rows in the block.
+ */
+static inline unsigned int
+pack_decode_columns(const char *p, int32_t cols[PACK_FIELDS][PACK_BLOCK_ROWS])
+{
+	const struct pack_block *b = (const struct pack_block *)p;
+	const uint32_t *words = (const uint32_t *)(p + sizeof(*b));
+	int f;
+
+	for (f = 0; f < PACK_FIELDS; f++) {
+		if (f && (b->flags & PACK_DERIVED))
+			break;
+		pack_decode_field(words, b->width[f], b->base[f], b->min[f],
+				  cols[f]);
+		words += PACK_LANES * b->width[f];
+	}
+	if (b->flags & PACK_DERIVED)
+		pack_derive(cols[0], cols[1], cols[2]);
+
+	return b->rows;
+}
+
+/* Decode a block into records, returns the number of rows */
+static inline unsigned int pack_decode_block(const char *p,
+					     struct threeNum *out)
+{
+	int32_t cols[PACK_FIELDS][PACK_BLOCK_ROWS];
+	struct threenum_columns c = { cols[0], cols[1], cols[2] };
+	unsigned int rows;
+
+	rows = pack_decode_columns(p, cols);
+	threenum_join(out, &c, rows);
+
+	return rows;
+}
+
+/* Writer */
+
+/**
+ * pack_writer_open: create a compressed record file.
+ * @pw: writer
+ * @path: file, truncated
+ */
+static inline int pack_writer_open(struct pack_writer *pw, const char *path)
+{
+	memset(pw, 0, sizeof(*pw));
+	memcpy(pw->hdr.magic, PACK_MAGIC, sizeof(pw->hdr.magic));
+	pw->hdr.version = PACK_VERSION;
+	pw->hdr.block_rows = PACK_BLOCK_ROWS;
+
+	if (record_writer_open(&pw->w, path, sizeof(uint32_t), 0, 0))
+		return -1;
+
+	/* Placeholder, the real one goes in on close */
+	if (record_writer_write(&pw->w, &pw->hdr, sizeof(pw->hdr))) {
+		record_writer_close(&pw->w);
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline int pack_writer_flush_block(struct pack_writer *pw)
+{
+	uint32_t d[PACK_BLOCK_ROWS], words[PACK_LANES * 32];
+	struct pack_block b;
+	uint32_t n1, n2, prev;
+	int32_t *x, min;
+	unsigned int i;
+	int f, derived = 1;
+
+	if (!pw->rows)
+		return 0;
+
+	/* Pad with the last row, keeps the deltas and the width small */
+	for (f = 0; f < PACK_FIELDS; f++)
+		for (i = pw->rows; i < PACK_BLOCK_ROWS; i++)
+			pw->col[f][i] = pw->col[f][pw->rows - 1];
+
+	for (i = 0; i < PACK_BLOCK_ROWS && derived; i++) {
+		n1 = pw->col[0][i];
+		n2 = pw->col[1][i];
+		derived = n2 == 5 * n1 && (uint32_t)pw->col[2][i] == n2 + 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.rows = pw->rows;
+	b.flags = derived ? PACK_DERIVED : 0;
+
+	/* Headers first, the widths are needed to size the block */
+	for (f = 0; f < PACK_FIELDS; f++) {
+		x = pw->col[f];
+		b.base[f] = x[0];
+		min = INT32_MAX;
+		for (i = 0; i < PACK_BLOCK_ROWS; i++) {
+			prev = i < PACK_LANES ? x[0] : x[i - PACK_LANES];
+			d[i] = (uint32_t)x[i] - prev;
+			if ((int32_t)d[i] < min)
+				min = d[i];
+		}
+		b.min[f] = min;
+		for (i = 0; i < PACK_BLOCK_ROWS; i++)
+			d[i] -= (uint32_t)min;
+		b.width[f] = pack_width(d);
+		if (derived && f)
+			b.width[f] = 0;
+	}
+	if (record_writer_write(&pw->w, &b, sizeof(b)))
+		return -1;
+
+	for (f = 0; f < PACK_FIELDS; f++) {
+		if (derived && f)
+			break;
+		x = pw->col[f];
+		for (i = 0; i < PACK_BLOCK_ROWS; i++) {
+			prev = i < PACK_LANES ? x[0] : x[i - PACK_LANES];
+			d[i] = (uint32_t)x[i] - prev - (uint32_t)b.min[f];
+		}
+		pack_bits(d, b.width[f], words);
+		if (record_writer_write(&pw->w, words, PACK_LANES *
+					b.width[f] * sizeof(uint32_t)))
+			return -1;
+	}
+
+	pw->hdr.count += pw->rows;
+	pw->hdr.nblocks++;
+	pw->rows = 0;
+
+	return 0;
+}
+
+static inline int pack_writer_append(struct pack_writer *pw,
+				     const struct threeNum *num)
+{
+	struct threenum_columns c = {
+		pw->col[0] + pw->rows, pw->col[1] + pw->rows, pw->col[2] + pw->rows
+	};
+
+	threenum_split(&c, num, 1);
+
+	if (++pw->rows == PACK_BLOCK_ROWS)
+		return pack_writer_flush_block(pw);
+
+	return 0;
+}
+
+static inline int pack_writer_close(struct pack_writer *pw)
+{
+	int ret;
+
+	ret = pack_writer_flush_block(pw);
+	if (!ret)
+		ret = record_writer_finish(&pw->w);
+	if (!ret && pwrite(pw->w.fd, &pw->hdr, sizeof(pw->hdr), 0) !=
+		    sizeof(pw->hdr))
+		ret = -1;
+	if (record_writer_close(&pw->w))
+		ret = -1;
+
+	return ret;
+}
+
+/* Reader */
+
+static inline int pack_reader_open(struct pack_reader *pr, const char *path)
+{
+	const char *p, *end;
+	uint64_t b, rows = 0;
+
+	if (record_map_open(&pr->m, path, 1, RECORD_ACCESS_SEQUENTIAL))
+		return -1;
+
+	pr->hdr = (const struct pack_header *)pr->m.base;
+	if (pr->m.len < sizeof(*pr->hdr) ||
+	    memcmp(pr->hdr->magic, PACK_MAGIC, sizeof(pr->hdr->magic)) ||
+	    pr->hdr->version != PACK_VERSION ||
+	    pr->hdr->block_rows != PACK_BLOCK_ROWS)
+		goto bad;
+
+	/*
+	 * Walk the block headers once: sizes, row counts and widths are
+	 * checked here so decoding needs no bounds checks.
+	 */
+	pr->first = pr->m.base + sizeof(*pr->hdr);
+	end = pr->m.base + pr->m.len;
+	for (p = pr->first, b = 0; b < pr->hdr->nblocks; b++) {
+		if ((size_t)(end - p) < sizeof(struct pack_block) ||
+		    !pack_block_valid((const void *)p) ||
+		    (size_t)(end - p) < pack_block_size((const void *)p))
+			goto corrupt;
+		rows += ((const struct pack_block *)p)->rows;
+		p += pack_block_size((const void *)p);
+	}
+	if (p != end || rows != pr->hdr->count)
+		goto corrupt;
+
+	return 0;
+
+bad:
+	record_map_close(&pr->m);
+	errno = EINVAL;
+	return -1;
+
+corrupt:
+	record_map_close(&pr->m);
+	errno = EBADMSG;
+	return -1;
+}
+
+static inline void pack_reader_close(struct pack_reader *pr)
+{
+	record_map_close(&pr->m);
+}
+
+/* Block after p, NULL at the end */
+static inline const char *pack_next_block(const struct pack_reader *pr,
+					  const char *p)
+{
+	p += pack_block_size((const struct pack_block *)p);
+	return p < pr->m.base + pr->m.len ? p : NULL;
+}
+
+static inline const char *pack_first_block(const struct pack_reader *pr)
+{
+	return pr->hdr->nblocks ? pr->first : NULL;
+}
+
+#endif /* RECORD_PACK_H */
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "threenum.h"
+#include "record_file.h"
+#include "record_schema.h"
+#include "record_scan.h"
+
+/*
+ * Reads the struct threeNum records fwrite.c wrote to program.bin through
+ * a memory mapping.
+ *
+ *	record_read		print every record
+ *	record_read -s		only sum the fields, sequential scan
+ *	record_read -i 5 -i 2	print records 5 and 2, random access
+ *	record_read -s -j 8	sum with 8 threads over mapped chunks
+ *	record_read -s -j 8 -P	same, chunks read with pread()
+ *	record_read -v		check the CRC32C of every block
+ *	record_read -f <file>	read file instead of program.bin
+ *
+ * gcc record_read.c -lpthread -o record_read
+ */
+#define MAX_LOOKUPS	64
+
+struct field_sums {
+	long long s1, s2, s3;
+};
+
+static void sum_chunk(void *acc, const void *recs, size_t first, size_t count)
+{
+	const struct threeNum *num = recs;
+	struct field_sums *sum = acc;
+	size_t i;
+
+	(void)first;
+	for (i = 0; i < count; i++) {
+		sum->s1 += num[i].n1;
+		sum->s2 += num[i].n2;
+		sum->s3 += num[i].n3;
+	}
+}
+
+static void sum_reduce(void *result, const void *part)
+{
+	const struct field_sums *p = part;
+	struct field_sums *r = result;
+
+	r->s1 += p->s1;
+	r->s2 += p->s2;
+	r->s3 += p->s3;
+}
+
+static int parallel_sum(const char *path, int threads,
+			enum record_scan_mode mode)
+{
+	struct field_sums sum = { 0, 0, 0 };
+	struct record_scan s;
+
+	if (record_scan_open(&s, path, sizeof(struct threeNum),
+			     THREENUM_SCHEMA)) {
+		perror(path);
+		return 1;
+	}
+	if (record_scan_run(&s, threads, mode, sizeof(sum), sum_chunk,
+			    sum_reduce, &sum)) {
+		perror(path);
+		record_scan_close(&s);
+		return 1;
+	}
+
+	printf("%s: %zu records, %d threads\n", path, s.m.count, threads);
+	printf("sum n1: %lld\tn2: %lld\tn3: %lld\n", sum.s1, sum.s2, sum.s3);
+	record_scan_close(&s);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "program.bin";
+	size_t lookups[MAX_LOOKUPS];
+	int nlookups = 0, sum_only = 0, verify = 0, threads = 0;
+	enum record_scan_mode mode = RECORD_SCAN_MMAP;
+	const struct threeNum *num;
+	long long s1 = 0, s2 = 0, s3 = 0;
+	struct record_iter it;
+	struct record_map m;
+	ssize_t bad;
+	int c, k;
+
+	while ((c = getopt(argc, argv, "f:i:svj:P")) != -1)
+		switch (c) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'i':
+			if (nlookups == MAX_LOOKUPS) {
+				fprintf(stderr, "At most %d -i\n", MAX_LOOKUPS);
+				return 1;
+			}
+			lookups[nlookups++] = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sum_only = 1;
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'P':
+			mode = RECORD_SCAN_PREAD;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f file] [-s [-j threads] [-P]] [-v] "
+				"[-i index]...\n",
+				argv[0]);
+			return 1;
+		}
+
+	if (threads > 0 && (!sum_only || nlookups)) {
+		fprintf(stderr, "-j only applies to -s without -i\n");
+		return 1;
+	}
+	if (sum_only && threads > 0 && !verify)
+		return parallel_sum(path, threads, mode);
+
+	if (threenum_file_map(&m, path, nlookups ? RECORD_ACCESS_RANDOM :
+						   RECORD_ACCESS_SEQUENTIAL)) {
+		perror(path);
+		return 1;
+	}
+	/* A raw dump starts with its records, a live file has no CRCs yet */
+	printf("%s: %zu records%s\n", path, m.count,
+	       m.data == m.base ? " (no header)" :
+	       m.crcs ? "" : " (live)");
+
+	if (verify) {
+		bad = record_file_verify(&m);
+		if (bad >= 0) {
+			printf("block %zd (records %zu+) fails CRC32C\n",
+			       bad, bad * m.block_records);
+			record_map_close(&m);
+			return 1;
+		}
+		if (bad == RECORD_FILE_VERIFY_NONE)
+			printf("no CRC32C to verify\n");
+		else
+			printf("CRC32C ok\n");
+	}
+
+	/* Verified sequentially, summed in parallel */
+	if (sum_only && threads > 0) {
+		record_map_close(&m);
+		return parallel_sum(path, threads, mode);
+	}
+
+	for (k = 0; k < nlookups; k++) {
+		num = record_map_get(&m, lookups[k]);
+		if (!num) {
+			printf("[%zu] out of range\n", lookups[k]);
+			continue;
+		}
+		printf("[%zu] n1: %d\tn2: %d\tn3: %d\n", lookups[k],
+		       num->n1, num->n2, num->n3);
+	}
+
+	if (!nlookups) {
+		record_iter_init(&it, &m);
+		while ((num = record_iter_next(&it)) != NULL) {
+			if (sum_only) {
+				s1 += num->n1;
+				s2 += num->n2;
+				s3 += num->n3;
+			} else {
+				printf("n1: %d\tn2: %d\tn3: %d\n",
+				       num->n1, num->n2, num->n3);
+			}
+		}
+		if (sum_only)
+			printf("sum n1: %lld\tn2: %lld\tn3: %lld\n", s1, s2, s3);
+	}
+
+	record_map_close(&m);
+	return 0;
+}
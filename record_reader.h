@@ -0,0 +1,141 @@
+#ifndef RECORD_READER_H
+#define RECORD_READER_H
+
+/*
+ * Memory-mapped record reader.
+ *
+ * Maps a record file such as program.bin read only and gives O(1) access
+ * to record i and a zero-copy iterator over all of them: records are
+ * used in place in the page cache, nothing is copied into user buffers.
+ * The expected access pattern is passed to madvise() so the kernel reads
+ * ahead aggressively for scans and does not for random probes.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum record_access {
+	RECORD_ACCESS_SEQUENTIAL,
+	RECORD_ACCESS_RANDOM,
+};
+
+struct record_map {
+	const char *base;	/* Start of the mapping */
+	size_t len;		/* Bytes mapped */
+	const char *data;	/* First record */
+	size_t rec_size;
+	size_t count;		/* Number of records */
+	const uint32_t *crcs;	/* Per block CRC32C, record_file.h files only */
+	size_t block_records;	/* Records per CRC block */
+};
+
+struct record_iter {
+	const char *p;
+	const char *end;
+	size_t rec_size;
+};
+
+static inline int record_map_advise(struct record_map *m,
+				    enum record_access access)
+{
+	if (!m->len)
+		return 0;
+	return madvise((void *)m->base, m->len,
+		       access == RECORD_ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL :
+							    MADV_RANDOM);
+}
+
+/**
+ * record_map_open: map a file of fixed size records.
+ * @m: returns the mapping
+ * @path: record file
+ * @rec_size: size of one record, e.g. sizeof(struct threeNum)
+ * @access: expected access pattern
+ *
+ * Fails with EINVAL if the file size is not a multiple of rec_size, i.e.
+ * it holds some other record type or is truncated.
+ */
+static inline int record_map_open(struct record_map *m, const char *path,
+				  size_t rec_size, enum record_access access)
+{
+	struct stat st;
+	void *base = NULL;
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	if (!rec_size || st.st_size % rec_size) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* mmap() of 0 bytes fails, an empty file is just no records */
+	if (st.st_size) {
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+
+	m->base = base;
+	m->len = st.st_size;
+	m->data = base;
+	m->rec_size = rec_size;
+	m->count = st.st_size / rec_size;
+	record_map_advise(m, access);
+
+	return 0;
+}
+
+static inline void record_map_close(struct record_map *m)
+{
+	if (m->len)
+		munmap((void *)m->base, m->len);
+	memset(m, 0, sizeof(*m));
+}
+
+/* Record i, NULL if out of range */
+static inline const void *record_map_get(const struct record_map *m, size_t i)
+{
+	if (i >= m->count)
+		return NULL;
+	return m->data + i * m->rec_size;
+}
+
+static inline void record_iter_init(struct record_iter *it,
+				    const struct record_map *m)
+{
+	it->p = m->data;
+	it->end = m->data + m->count * m->rec_size;
+	it->rec_size = m->rec_size;
+}
+
+/* Next record in place, NULL at the end */
+static inline const void *record_iter_next(struct record_iter *it)
+{
+	const char *rec = it->p;
+
+	if (rec == it->end)
+		return NULL;
+	it->p += it->rec_size;
+	return rec;
+}
+
+#endif /* RECORD_READER_H */
@@ -0,0 +1,244 @@
+#ifndef RECORD_SCAN_H
+#define RECORD_SCAN_H
+
+/*
+ * Parallel scans of record files.
+ *
+ * The records are cut into record aligned chunks of about
+ * RECORD_SCAN_CHUNK bytes, handed out to worker threads through an
+ * atomic counter, so a fast thread takes more chunks than one stalled
+ * on I/O. Every worker folds its chunks into a private accumulator and
+ * the accumulators are combined by a reduce step at the end, in thread
+ * order, without any locking on the way.
+ *
+ * Workers read either straight from a shared mapping of the file or
+ * with pread() into a buffer of their own; the latter avoids page fault
+ * overhead on very large files and lets the kernel see concurrent
+ * streams:
+ *
+ *	static void sum(void *acc, const void *recs, size_t first, size_t n);
+ *	static void add(void *acc, const void *part);
+ *
+ *	record_scan_open(&s, "program.bin", sizeof(struct threeNum), NULL);
+ *	record_scan_run(&s, 8, RECORD_SCAN_PREAD, sizeof(acc), sum, add, &acc);
+ *
+ *	gcc ... -lpthread
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "record_file.h"
+
+#define RECORD_SCAN_CHUNK	(4 << 20)
+#define RECORD_SCAN_ALIGN	64	/* Keeps accumulators off shared lines */
+
+enum record_scan_mode {
+	RECORD_SCAN_MMAP,
+	RECORD_SCAN_PREAD,
+};
+
+/* Fold count records, numbers first.., into acc */
+typedef void (*record_scan_fn)(void *acc, const void *recs, size_t first,
+			       size_t count);
+/* Combine a worker's accumulator into the result */
+typedef void (*record_reduce_fn)(void *result, const void *part);
+
+struct record_scan {
+	struct record_map m;
+	int fd;			/* For pread() */
+	off_t data_off;		/* File offset of record 0 */
+};
+
+struct record_scan_worker {
+	struct record_scan *s;
+	enum record_scan_mode mode;
+	size_t chunk_records;
+	size_t nchunks;
+	size_t *next;		/* Shared chunk counter */
+	record_scan_fn fn;
+	void *acc;
+	int error;
+};
+
+/**
+ * record_scan_open: open a record file for parallel scans.
+ * @s: scan
+ * @path: file, with or without a record_file.h header
+ * @rec_size: record size
+ * @schema: schema expected, NULL to accept any
+ */
+static inline int record_scan_open(struct record_scan *s, const char *path,
+				   size_t rec_size, const char *schema)
+{
+	if (record_file_map(&s->m, path, rec_size, schema,
+			    RECORD_ACCESS_SEQUENTIAL))
+		return -1;
+
+	s->fd = open(path, O_RDONLY);
+	if (s->fd < 0) {
+		record_map_close(&s->m);
+		return -1;
+	}
+	s->data_off = s->m.data - s->m.base;
+
+	return 0;
+}
+
+static inline void record_scan_close(struct record_scan *s)
+{
+	record_map_close(&s->m);
+	close(s->fd);
+}
+
+static inline int record_scan_pread(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!ret) {
+			/* File shrank under us */
+			errno = EIO;
+			return -1;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static inline void *record_scan_worker(void *arg)
+{
+	struct record_scan_worker *w = arg;
+	const struct record_map *m = &w->s->m;
+	size_t c, first, count, len;
+	char *buf = NULL;
+
+	if (w->mode == RECORD_SCAN_PREAD) {
+		buf = malloc(w->chunk_records * m->rec_size);
+		if (!buf) {
+			w->error = errno;
+			return NULL;
+		}
+	}
+
+	while ((c = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) <
+	       w->nchunks) {
+		first = c * w->chunk_records;
+		count = m->count - first;
+		if (count > w->chunk_records)
+			count = w->chunk_records;
+		len = count * m->rec_size;
+
+		if (w->mode == RECORD_SCAN_MMAP) {
+			w->fn(w->acc, m->data + first * m->rec_size, first,
+			      count);
+			continue;
+		}
+
+		if (record_scan_pread(w->s->fd, buf, len,
+				      w->s->data_off + first * m->rec_size)) {
+			w->error = errno;
+			break;
+		}
+		w->fn(w->acc, buf, first, count);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/**
+ * record_scan_run: scan all records with several threads.
+ * @s: scan
+ * @threads: worker threads
+ * @mode: RECORD_SCAN_MMAP or RECORD_SCAN_PREAD
+ * @acc_size: size of an accumulator; each worker's starts zeroed
+ * @fn: folds a run of records into a worker's accumulator
+ * @reduce: folds a worker's accumulator into result
+ * @result: final result, not cleared first
+ */
+static inline int record_scan_run(struct record_scan *s, int threads,
+				  enum record_scan_mode mode, size_t acc_size,
+				  record_scan_fn fn, record_reduce_fn reduce,
+				  void *result)
+{
+	struct record_scan_worker *w;
+	pthread_t *tid;
+	size_t next = 0, stride, chunk_records;
+	char *accs;
+	int t, started = 0, ret = 0;
+
+	if (threads < 1)
+		threads = 1;
+
+	chunk_records = RECORD_SCAN_CHUNK / s->m.rec_size;
+	if (!chunk_records)
+		chunk_records = 1;
+
+	stride = (acc_size + RECORD_SCAN_ALIGN - 1) &
+		 ~(size_t)(RECORD_SCAN_ALIGN - 1);
+	if (!stride)
+		stride = RECORD_SCAN_ALIGN;
+
+	w = calloc(threads, sizeof(*w));
+	tid = calloc(threads, sizeof(*tid));
+	accs = aligned_alloc(RECORD_SCAN_ALIGN, threads * stride);
+	if (!w || !tid || !accs) {
+		ret = -1;
+		goto out;
+	}
+	memset(accs, 0, threads * stride);
+
+	if (mode == RECORD_SCAN_MMAP && s->m.len)
+		madvise((void *)s->m.base, s->m.len, MADV_SEQUENTIAL);
+
+	for (t = 0; t < threads; t++) {
+		w[t].s = s;
+		w[t].mode = mode;
+		w[t].chunk_records = chunk_records;
+		w[t].nchunks = (s->m.count + chunk_records - 1) / chunk_records;
+		w[t].next = &next;
+		w[t].fn = fn;
+		w[t].acc = accs + t * stride;
+		errno = pthread_create(&tid[t], NULL, record_scan_worker, &w[t]);
+		if (errno) {
+			ret = -1;
+			break;
+		}
+		started++;
+	}
+
+	for (t = 0; t < started; t++) {
+		pthread_join(tid[t], NULL);
+		if (w[t].error) {
+			errno = w[t].error;
+			ret = -1;
+		}
+	}
+
+	if (!ret)
+		for (t = 0; t < threads; t++)
+			reduce(result, w[t].acc);
+
+out:
+	free(w);
+	free(tid);
+	free(accs);
+	return ret;
+}
+
+#endif /* RECORD_SCAN_H */
@@ -0,0 +1,195 @@
+#ifndef RECORD_SCHEMA_H
+#define RECORD_SCHEMA_H
+
+/*
+ * Compile-time record schemas.
+ *
+ * A record type is described once, as an X-macro list of its fields
+ * with a schema type each that passes the struct type T through, and
+ * RECORD_SCHEMA() expands it into the code that is otherwise written by
+ * hand for every type:
+ *
+ *	#define THREENUM_FIELDS(X, T)	\
+ *		X(T, i32, n1)		\
+ *		X(T, i32, n2)		\
+ *		X(T, i32, n3)
+ *
+ *	RECORD_SCHEMA(threenum, struct threeNum, THREENUM_FIELDS)
+ *
+ * gives, for struct threeNum:
+ *
+ *	threenum_packed_size	bytes of a packed record, no padding
+ *	threenum_nfields	number of fields
+ *	threenum_schema()	"n1:i32,n2:i32,n3:i32", as in the file header,
+ *				which it has to fit or the list doesn't compile
+ *	threenum_pack()		records to packed bytes, fields in list order
+ *	struct threenum_columns	one array pointer per field
+ *	threenum_split()	records to column arrays
+ *	threenum_join()		column arrays to records
+ *	threenum_file_open()	record_file.h file of packed records
+ *	threenum_file_append()
+ *	threenum_file_map()
+ *
+ * Packed records are in host byte order like everything record_file.h
+ * writes; its header records the byte order. Every field's C type is
+ * checked against its schema type when the list is expanded, so a list
+ * that drifts from the struct doesn't compile. When the packed layout
+ * is the struct's own (no padding, fields in order) packing is a
+ * memcpy(), and the compiler folds that test away; the readers rely on
+ * it for struct threeNum and take mapped records as they are.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "threenum.h"
+#include "record_file.h"
+
+/* C type of each schema type */
+#define RS_CTYPE_i8	int8_t
+#define RS_CTYPE_u8	uint8_t
+#define RS_CTYPE_i16	int16_t
+#define RS_CTYPE_u16	uint16_t
+#define RS_CTYPE_i32	int32_t
+#define RS_CTYPE_u32	uint32_t
+#define RS_CTYPE_i64	int64_t
+#define RS_CTYPE_u64	uint64_t
+#define RS_CTYPE_f32	float
+#define RS_CTYPE_f64	double
+
+#define RS_CTYPE(tag)	RS_CTYPE_##tag
+
+/* Field list expanders */
+#define RS_SIZE(T, tag, name)	+ sizeof(RS_CTYPE(tag))
+#define RS_COUNT(T, tag, name)	+ 1
+#define RS_SCHEMA(T, tag, name)	"," #name ":" #tag
+#define RS_COLUMN(T, tag, name)	RS_CTYPE(tag) *name;
+
+#define RS_CHECK(T, tag, name)						\
+	_Static_assert(__builtin_types_compatible_p(			\
+			__typeof__(((T *)0)->name), RS_CTYPE(tag)),	\
+		       #T "." #name " is not " #tag);
+
+#define RS_DENSE(T, tag, name)						\
+	dense &= offsetof(T, name) == off;				\
+	off += sizeof(RS_CTYPE(tag));
+
+#define RS_PACK(T, tag, name)						\
+	memcpy(p, &src[i].name, sizeof(RS_CTYPE(tag)));			\
+	p += sizeof(RS_CTYPE(tag));
+
+/* One loop per field, which vectorizes where a loop per record doesn't */
+#define RS_SPLIT(T, tag, name)						\
+	for (i = 0; i < n; i++)						\
+		c->name[i] = src[i].name;
+
+#define RS_JOIN(T, tag, name)						\
+	for (i = 0; i < n; i++)						\
+		dst[i].name = c->name[i];
+
+/* Expand FIELDS into the code for record type T, prefixed name_ */
+#define RECORD_SCHEMA(name, T, FIELDS)					\
+FIELDS(RS_CHECK, T)							\
+									\
+enum {									\
+	name##_packed_size = 0 FIELDS(RS_SIZE, T),			\
+	name##_nfields = 0 FIELDS(RS_COUNT, T),				\
+};									\
+									\
+static const char name##_schema_list[] = "" FIELDS(RS_SCHEMA, T);	\
+									\
+/* The list's leading comma stands in for the schema's NUL */		\
+_Static_assert(sizeof(name##_schema_list) - 1 <=			\
+	       sizeof(((struct record_file_header *)0)->schema),	\
+	       #name " schema too long for the record file header");	\
+									\
+static inline const char *name##_schema(void)				\
+{									\
+	return name##_schema_list + 1;					\
+}									\
+									\
+struct name##_columns {							\
+	FIELDS(RS_COLUMN, T)						\
+};									\
+									\
+/* Packed layout is the struct's own */					\
+static inline int name##_dense(void)					\
+{									\
+	size_t off = 0;							\
+	int dense = 1;							\
+									\
+	FIELDS(RS_DENSE, T)						\
+	return dense && off == sizeof(T);				\
+}									\
+									\
+/* Pack n records into dst, returns the bytes written */		\
+static inline size_t name##_pack(void *dst, const T *src, size_t n)	\
+{									\
+	char *p = dst;							\
+	size_t i;							\
+									\
+	if (name##_dense()) {						\
+		memcpy(dst, src, n * sizeof(T));			\
+		return n * sizeof(T);					\
+	}								\
+	for (i = 0; i < n; i++) {					\
+		FIELDS(RS_PACK, T)					\
+	}								\
+	return p - (char *)dst;						\
+}									\
+									\
+/* Field arrays of c get n values each */				\
+static inline void name##_split(const struct name##_columns *c,		\
+				const T *src, size_t n)			\
+{									\
+	size_t i;							\
+									\
+	FIELDS(RS_SPLIT, T)						\
+}									\
+									\
+static inline void name##_join(T *dst, const struct name##_columns *c,	\
+			       size_t n)				\
+{									\
+	size_t i;							\
+									\
+	FIELDS(RS_JOIN, T)						\
+}									\
+									\
+/* buf_size and threshold as for record_file_open() */			\
+static inline int name##_file_open(struct record_file_writer *fw,	\
+				   const char *path, size_t buf_size,	\
+				   size_t threshold)			\
+{									\
+	return record_file_open(fw, path, name##_packed_size,		\
+				name##_schema(), buf_size, threshold);	\
+}									\
+									\
+static inline int name##_file_append(struct record_file_writer *fw,	\
+				     const T *rec)			\
+{									\
+	char buf[name##_packed_size];					\
+									\
+	name##_pack(buf, rec, 1);					\
+	return record_file_append(fw, buf);				\
+}									\
+									\
+/* Packed records at m->data, T's own layout when dense */		\
+static inline int name##_file_map(struct record_map *m,			\
+				  const char *path,			\
+				  enum record_access access)		\
+{									\
+	return record_file_map(m, path, name##_packed_size,		\
+			       name##_schema(), access);		\
+}
+
+#define THREENUM_FIELDS(X, T)						\
+	X(T, i32, n1)							\
+	X(T, i32, n2)							\
+	X(T, i32, n3)
+
+RECORD_SCHEMA(threenum, struct threeNum, THREENUM_FIELDS)
+
+/* Schema of struct threeNum, as the file headers carry it */
+#define THREENUM_SCHEMA	threenum_schema()
+
+#endif /* RECORD_SCHEMA_H */
@@ -0,0 +1,595 @@
+#ifndef RECORD_WRITER_H
+#define RECORD_WRITER_H
+
+/*
+ * Batched record writer.
+ *
+ * Records are copied into a large user space buffer and written out with
+ * write()/writev() in multi-MB batches, instead of going through stdio
+ * one fwrite() (one lock, one bookkeeping round) per record. Arrays of
+ * records that don't fit the buffer are written straight from the caller
+ * together with what is buffered, in a single writev().
+ *
+ * record_writer_async() moves the writes to a background thread: the
+ * producer fills one buffer while the thread writes the other, and a
+ * full buffer is handed over with one atomic store, so generating records
+ * and disk I/O overlap and the producer only waits when the disk is
+ * slower than it is.
+ *
+ * record_writer_direct() switches to O_DIRECT for bulk dumps that would
+ * otherwise push the hot working set out of the page cache. Buffers are
+ * RW_ALIGN aligned (from a small pool, so writers opened one after the
+ * other reuse them), only whole aligned blocks are flushed, and the last
+ * partial block goes out through the page cache on close.
+ *
+ * Header only, include it after defining _GNU_SOURCE (for O_DIRECT) and
+ * compile as usual:
+ *	gcc fwrite.c -lpthread
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifndef O_DIRECT
+#error "define _GNU_SOURCE before the first #include"
+#endif
+
+#define RECORD_WRITER_BUF_SIZE	(4 << 20)
+#define RW_ALIGN		4096	/* O_DIRECT buffer, offset, length */
+#define RW_POOL_SIZE		4
+
+/* Handoff between the producer and the writer thread, also a futex */
+enum {
+	RW_IDLE,		/* Thread waits for a buffer */
+	RW_FULL,		/* Buffer posted, being written */
+	RW_STOP,
+};
+
+struct rw_async {
+	pthread_t thread;
+	int fd;
+	uint32_t state;
+	const char *buf;	/* Posted buffer */
+	size_t len;
+	char *spare;		/* Buffer the producer fills next */
+	int error;		/* errno of a failed write */
+};
+
+/* Free aligned buffers, kept for the next writer */
+static struct {
+	pthread_mutex_t lock;
+	void *buf[RW_POOL_SIZE];
+	size_t size[RW_POOL_SIZE];
+} rw_pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { 0 } };
+
+struct record_writer {
+	int fd;
+	int direct;		/* O_DIRECT, flush whole RW_ALIGN blocks only */
+	size_t rec_size;
+	char *buf;
+	size_t buf_size;
+	size_t flush_threshold;	/* Flush once this many bytes are buffered */
+	size_t fill;
+
+	/* Statistics */
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t flushes;
+	uint64_t stalls;	/* Waits for the writer thread */
+	double stall_secs;
+	struct timespec start;
+
+	struct rw_async *async;	/* Writer thread, NULL when synchronous */
+};
+
+static inline double rw_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* writev() everything in iov, restarting after short writes */
+static inline int rw_writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t r;
+
+	while (iovcnt) {
+		r = writev(fd, iov, iovcnt);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+
+		while (iovcnt && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+static inline size_t rw_align_up(size_t n)
+{
+	return (n + RW_ALIGN - 1) & ~(size_t)(RW_ALIGN - 1);
+}
+
+/* RW_ALIGN aligned buffer of size bytes, from the pool if it has one */
+static inline void *rw_buf_get(size_t size)
+{
+	void *buf = NULL;
+	int i;
+
+	pthread_mutex_lock(&rw_pool.lock);
+	for (i = 0; i < RW_POOL_SIZE; i++)
+		if (rw_pool.buf[i] && rw_pool.size[i] == size) {
+			buf = rw_pool.buf[i];
+			rw_pool.buf[i] = NULL;
+			break;
+		}
+	pthread_mutex_unlock(&rw_pool.lock);
+
+	return buf ? buf : aligned_alloc(RW_ALIGN, size);
+}
+
+static inline void rw_buf_put(void *buf, size_t size)
+{
+	int i;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&rw_pool.lock);
+	for (i = 0; i < RW_POOL_SIZE; i++)
+		if (!rw_pool.buf[i]) {
+			rw_pool.buf[i] = buf;
+			rw_pool.size[i] = size;
+			buf = NULL;
+			break;
+		}
+	pthread_mutex_unlock(&rw_pool.lock);
+
+	free(buf);
+}
+
+/*
+ * Write a whole buffer. O_DIRECT is dropped and the write retried if the
+ * filesystem refuses it (EINVAL, e.g. tmpfs).
+ */
+static inline int rw_write_buf(int fd, const char *buf, size_t len)
+{
+	struct iovec iov;
+	int flags;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	if (!rw_writev_full(fd, &iov, 1))
+		return 0;
+	if (errno != EINVAL)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || !(flags & O_DIRECT) ||
+	    fcntl(fd, F_SETFL, flags & ~O_DIRECT)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return rw_writev_full(fd, &iov, 1);
+}
+
+static inline void rw_futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void rw_futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void *rw_async_thread(void *arg)
+{
+	struct rw_async *a = arg;
+	uint32_t state;
+
+	for (;;) {
+		while ((state = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE)) ==
+		       RW_IDLE)
+			rw_futex_wait(&a->state, RW_IDLE);
+		if (state == RW_STOP)
+			break;
+
+		if (!a->error && rw_write_buf(a->fd, a->buf, a->len))
+			a->error = errno;
+
+		__atomic_store_n(&a->state, RW_IDLE, __ATOMIC_RELEASE);
+		rw_futex_wake(&a->state);
+	}
+
+	return NULL;
+}
+
+/* Wait for the buffer in flight, if any, to be written */
+static inline int rw_async_wait(struct record_writer *w)
+{
+	struct rw_async *a = w->async;
+	struct timespec start;
+
+	if (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE) != RW_IDLE) {
+		w->stalls++;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE) != RW_IDLE)
+			rw_futex_wait(&a->state, RW_FULL);
+		w->stall_secs += rw_elapsed(&start);
+	}
+
+	if (a->error) {
+		errno = a->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * record_writer_open: create path and start writing records to it.
+ * @w: writer
+ * @path: file, truncated
+ * @rec_size: size of one record
+ * @buf_size: buffer size in bytes, 0 for RECORD_WRITER_BUF_SIZE, rounded
+ *	up to RW_ALIGN
+ * @flush_threshold: flush once this many bytes are buffered, 0 for buf_size
+ *
+ * Returns 0, or -1 with errno set.
+ */
+static inline int record_writer_open(struct record_writer *w,
+				     const char *path, size_t rec_size,
+				     size_t buf_size, size_t flush_threshold)
+{
+	memset(w, 0, sizeof(*w));
+
+	if (!buf_size)
+		buf_size = RECORD_WRITER_BUF_SIZE;
+	if (buf_size < rec_size)
+		buf_size = rec_size;
+	buf_size = rw_align_up(buf_size);
+	if (!flush_threshold || flush_threshold > buf_size)
+		flush_threshold = buf_size;
+
+	w->buf = rw_buf_get(buf_size);
+	if (!w->buf)
+		return -1;
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd < 0) {
+		rw_buf_put(w->buf, buf_size);
+		return -1;
+	}
+
+	w->rec_size = rec_size;
+	w->buf_size = buf_size;
+	w->flush_threshold = flush_threshold;
+	clock_gettime(CLOCK_MONOTONIC, &w->start);
+
+	return 0;
+}
+
+/* Bytes of the buffer a flush can write now */
+static inline size_t rw_flush_len(const struct record_writer *w)
+{
+	return w->direct ? w->fill & ~(size_t)(RW_ALIGN - 1) : w->fill;
+}
+
+/*
+ * Hand the full buffer to the writer thread and switch to the spare.
+ * An unaligned O_DIRECT tail moves to the front of the spare.
+ */
+static inline int rw_async_post(struct record_writer *w)
+{
+	struct rw_async *a = w->async;
+	size_t len = rw_flush_len(w);
+	char *tmp;
+
+	if (!len)
+		return 0;
+	if (rw_async_wait(w))
+		return -1;
+
+	memcpy(a->spare, w->buf + len, w->fill - len);
+
+	a->buf = w->buf;
+	a->len = len;
+	__atomic_store_n(&a->state, RW_FULL, __ATOMIC_RELEASE);
+	rw_futex_wake(&a->state);
+
+	tmp = w->buf;
+	w->buf = a->spare;
+	a->spare = tmp;
+
+	w->bytes += len;
+	w->flushes++;
+	w->fill -= len;
+
+	return 0;
+}
+
+/**
+ * record_writer_async: write from a background thread from now on.
+ * @w: writer
+ *
+ * Allocates a second buffer of the same size. Returns 0, or -1 with
+ * errno set and the writer still usable synchronously.
+ */
+static inline int record_writer_async(struct record_writer *w)
+{
+	struct rw_async *a;
+
+	if (w->async)
+		return 0;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -1;
+	a->spare = rw_buf_get(w->buf_size);
+	if (!a->spare) {
+		free(a);
+		return -1;
+	}
+	a->fd = w->fd;
+
+	errno = pthread_create(&a->thread, NULL, rw_async_thread, a);
+	if (errno) {
+		rw_buf_put(a->spare, w->buf_size);
+		free(a);
+		return -1;
+	}
+	w->async = a;
+
+	return 0;
+}
+
+/* Wait until everything flushed so far has reached the file */
+static inline int record_writer_drain(struct record_writer *w)
+{
+	return w->async ? rw_async_wait(w) : 0;
+}
+
+/**
+ * record_writer_direct: bypass the page cache from now on.
+ * @w: writer, nothing flushed yet
+ *
+ * Buffers smaller than two RW_ALIGN blocks are grown so a flush always
+ * has a whole block to write.
+ */
+static inline int record_writer_direct(struct record_writer *w)
+{
+	size_t size = w->buf_size;
+	char *buf;
+	int flags;
+
+	if (w->bytes || w->async || w->rec_size > RW_ALIGN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (size < 2 * RW_ALIGN) {
+		size = 2 * RW_ALIGN;
+		buf = rw_buf_get(size);
+		if (!buf)
+			return -1;
+		memcpy(buf, w->buf, w->fill);
+		rw_buf_put(w->buf, w->buf_size);
+		w->buf = buf;
+		w->buf_size = size;
+	}
+
+	flags = fcntl(w->fd, F_GETFL);
+	if (flags < 0 || fcntl(w->fd, F_SETFL, flags | O_DIRECT))
+		return -1;
+	w->direct = 1;
+
+	return 0;
+}
+
+/* Write out the buffer; with O_DIRECT only its whole aligned blocks */
+static inline int record_writer_flush(struct record_writer *w)
+{
+	size_t len;
+
+	if (w->async)
+		return rw_async_post(w);
+
+	len = rw_flush_len(w);
+	if (!len)
+		return 0;
+	if (rw_write_buf(w->fd, w->buf, len))
+		return -1;
+
+	memmove(w->buf, w->buf + len, w->fill - len);
+	w->bytes += len;
+	w->flushes++;
+	w->fill -= len;
+
+	return 0;
+}
+
+/* Append one record */
+static inline int record_writer_append(struct record_writer *w,
+				       const void *rec)
+{
+	if (w->fill + w->rec_size > w->buf_size && record_writer_flush(w))
+		return -1;
+
+	memcpy(w->buf + w->fill, rec, w->rec_size);
+	w->fill += w->rec_size;
+	w->records++;
+
+	if (w->fill >= w->flush_threshold)
+		return record_writer_flush(w);
+
+	return 0;
+}
+
+/**
+ * record_writer_write: append raw bytes, e.g. a file header or footer.
+ * @w: writer
+ * @data: bytes
+ * @len: number of bytes
+ *
+ * Data too big for the free buffer space skips the copy and goes out in
+ * one writev() with what is buffered, except with O_DIRECT, where it
+ * has to go through the aligned buffer.
+ */
+static inline int record_writer_write(struct record_writer *w,
+				      const void *data, size_t len)
+{
+	struct iovec iov[2];
+	int iovcnt = 0;
+	size_t n;
+
+	while (w->direct && w->fill + len > w->buf_size) {
+		n = w->buf_size - w->fill;
+		memcpy(w->buf + w->fill, data, n);
+		w->fill += n;
+		data = (const char *)data + n;
+		len -= n;
+		if (record_writer_flush(w))
+			return -1;
+	}
+
+	if (w->fill + len <= w->buf_size) {
+		memcpy(w->buf + w->fill, data, len);
+		w->fill += len;
+		if (w->fill >= w->flush_threshold)
+			return record_writer_flush(w);
+		return 0;
+	}
+
+	/* Straight from the caller, after what the thread still writes */
+	if (record_writer_drain(w))
+		return -1;
+
+	if (w->fill) {
+		iov[iovcnt].iov_base = w->buf;
+		iov[iovcnt++].iov_len = w->fill;
+	}
+	iov[iovcnt].iov_base = (void *)data;
+	iov[iovcnt++].iov_len = len;
+	if (rw_writev_full(w->fd, iov, iovcnt))
+		return -1;
+
+	w->bytes += w->fill + len;
+	w->flushes++;
+	w->fill = 0;
+
+	return 0;
+}
+
+/* Append an array of records */
+static inline int record_writer_append_many(struct record_writer *w,
+					    const void *recs, size_t count)
+{
+	if (record_writer_write(w, recs, count * w->rec_size))
+		return -1;
+
+	w->records += count;
+	return 0;
+}
+
+/* Offset in the file the next byte written lands at */
+static inline uint64_t record_writer_offset(const struct record_writer *w)
+{
+	return w->bytes + w->fill;
+}
+
+/**
+ * record_writer_finish: write out everything buffered and wait for it.
+ * @w: writer
+ *
+ * With O_DIRECT the unaligned tail is written through the page cache and
+ * the file descriptor stays buffered from then on, so headers can be
+ * pwrite()n at any offset afterwards.
+ */
+static inline int record_writer_finish(struct record_writer *w)
+{
+	int flags;
+
+	if (record_writer_flush(w) || record_writer_drain(w))
+		return -1;
+
+	if (w->direct) {
+		flags = fcntl(w->fd, F_GETFL);
+		if (flags < 0 || fcntl(w->fd, F_SETFL, flags & ~O_DIRECT))
+			return -1;
+		w->direct = 0;
+		if (record_writer_flush(w) || record_writer_drain(w))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Flush and close, the writer statistics stay valid */
+static inline int record_writer_close(struct record_writer *w)
+{
+	struct rw_async *a = w->async;
+	int ret = record_writer_finish(w);
+
+	if (a) {
+		if (rw_async_wait(w))
+			ret = -1;
+		__atomic_store_n(&a->state, RW_STOP, __ATOMIC_RELEASE);
+		rw_futex_wake(&a->state);
+		pthread_join(a->thread, NULL);
+		rw_buf_put(a->spare, w->buf_size);
+		free(a);
+		w->async = NULL;
+	}
+
+	if (close(w->fd))
+		ret = -1;
+	rw_buf_put(w->buf, w->buf_size);
+	w->buf = NULL;
+
+	return ret;
+}
+
+/* Print records/s and MB/s since record_writer_open() */
+static inline void record_writer_stats(struct record_writer *w, FILE *out)
+{
+	double secs = rw_elapsed(&w->start);
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	fprintf(out, "%llu records, %llu bytes in %llu flushes, %.3fs: "
+		"%.0f records/s, %.1f MB/s\n",
+		(unsigned long long)w->records, (unsigned long long)w->bytes,
+		(unsigned long long)w->flushes, secs, w->records / secs,
+		w->bytes / secs / 1e6);
+	if (w->stalls)
+		fprintf(out, "producer waited for the writer thread %llu "
+			"times, %.3fs\n", (unsigned long long)w->stalls,
+			w->stall_secs);
+}
+
+#endif /* RECORD_WRITER_H */
@@ -43,13 +43,34 @@
  * The two matrices to be multiplied can be generated internally or entered
  * through files a.txt and b.txt. matrix A is read from a.txt and B from
  * b.txt
+ *
+ * Build: gcc matrix-mult.c -lpthread -lm
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #define DEBUG 0
 
@@ -155,19 +176,402 @@ struct matrix sub(struct matrix a, struct matrix b, int n)
 	return m;
 }
 
+/*
+ * Large buffers.
+ *
+ * Matrices and workspaces are mapped 2 MB aligned and 2 MB sized with
+ * MADV_HUGEPAGE so that they are backed by transparent huge pages, or
+ * from the hugetlb pool with --hugetlb (falling back to THP when the pool
+ * is empty). huge_prefault() touches every page from several threads so
+ * that page faults are taken before timing starts and not in the kernels.
+ *
+ * Below a huge page none of that pays: rounding up to 2 MB and faulting
+ * it in costs more than the TLB misses it saves. Such buffers come from
+ * the heap, page aligned for O_DIRECT, or from a plain shared mapping.
+ */
+#define HUGE_PAGE_SIZE	(2UL << 20)
+#define HUGE_PREFAULT_MAX_THREADS	16
+
+static bool use_hugetlb;
+
 /**
- * strassen_matrix_multiply: strassen's algo for matrix multiplication.
- * @m: structure holding a,b and c matrix where c = a x b
- * @n: number of row/column for each matrix
+ * huge_alloc: map a zeroed, 2 MB aligned buffer.
+ * @len: bytes needed, rounded up to a multiple of 2 MB from 2 MB on
+ * @shared: MAP_SHARED, to share the buffer with forked workers
+ *
+ * Returns NULL on failure. Free with huge_free(p, len, shared).
  */
-struct matrix strassen_matrix_multiply(struct matrix a, struct matrix b, int n)
+void *huge_alloc(size_t len, bool shared)
+{
+	int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS;
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *p, *aligned;
+	size_t head;
+
+	if (len < HUGE_PAGE_SIZE) {
+		len = (len + page - 1) & ~(page - 1);
+		if (shared) {
+			p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+			return p == MAP_FAILED ? NULL : p;
+		}
+		p = aligned_alloc(page, len);
+		if (p)
+			memset(p, 0, len);
+		return p;
+	}
+
+	len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+	if (use_hugetlb) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+			 -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+		print_debug("MAP_HUGETLB failed, using transparent huge pages\n");
+	}
+
+	/* Over-map by a huge page and trim to get the alignment */
+	p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) &
+			   ~(HUGE_PAGE_SIZE - 1));
+	head = aligned - p;
+	if (head)
+		munmap(p, head);
+	munmap(aligned + len, HUGE_PAGE_SIZE - head);
+
+	madvise(aligned, len, MADV_HUGEPAGE);
+
+	return aligned;
+}
+
+void huge_free(void *p, size_t len, bool shared)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (len < HUGE_PAGE_SIZE) {
+		if (shared)
+			munmap(p, (len + page - 1) & ~(page - 1));
+		else
+			free(p);
+		return;
+	}
+
+	len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	munmap(p, len);
+}
+
+struct prefault_range {
+	volatile char *start;
+	size_t len;
+	size_t step;
+};
+
+static void *prefault_thread(void *arg)
+{
+	struct prefault_range *r = arg;
+	size_t off;
+
+	/* The mapping is fresh and zeroed, writing 0 faults it in for write */
+	for (off = 0; off < r->len; off += r->step)
+		r->start[off] = 0;
+
+	return NULL;
+}
+
+/* Fault in a buffer from huge_alloc() using up to one thread per CPU */
+void huge_prefault(void *p, size_t len)
+{
+	struct prefault_range ranges[HUGE_PREFAULT_MAX_THREADS];
+	pthread_t tids[HUGE_PREFAULT_MAX_THREADS];
+	size_t pages, per_thread, step;
+	long ncpus;
+	int t, nthreads;
+
+	/* Small buffers aren't worth a thread, they fault in on first use */
+	if (len < HUGE_PAGE_SIZE)
+		return;
+
+	len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	step = sysconf(_SC_PAGESIZE);
+	pages = len / step;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus < 1 ? 1 : (ncpus > HUGE_PREFAULT_MAX_THREADS ?
+				    HUGE_PREFAULT_MAX_THREADS : ncpus);
+	/* Whole huge pages per thread, so a thread faults whole THPs */
+	per_thread = (len / HUGE_PAGE_SIZE + nthreads - 1) / nthreads *
+		     (HUGE_PAGE_SIZE / step);
+
+	for (t = 0; t < nthreads; t++) {
+		ranges[t].start = (char *)p + t * per_thread * step;
+		ranges[t].len = t * per_thread >= pages ? 0 :
+			(pages - t * per_thread < per_thread ?
+			 pages - t * per_thread : per_thread) * step;
+		ranges[t].step = step;
+	}
+
+	for (t = 1; t < nthreads; t++)
+		if (pthread_create(&tids[t], NULL, prefault_thread, &ranges[t]))
+			prefault_thread(&ranges[t]), tids[t] = 0;
+	prefault_thread(&ranges[0]);
+	for (t = 1; t < nthreads; t++)
+		if (tids[t])
+			pthread_join(tids[t], NULL);
+}
+
+/*
+ * Progress reporting.
+ *
+ * Every worker thread or process owns a cache line sized counter of the
+ * flops it completed, in a shared mapping so forked workers report too.
+ * The kernels count in a thread local variable and only publish it with a
+ * relaxed atomic add every PROGRESS_BATCH flops, so the hot loops neither
+ * share cache lines nor issue atomics per element.
+ *
+ * On SIGUSR1 a reporter thread prints percent done, current GFLOP/s and
+ * ETA on stderr, like dd(1) does.
+ */
+#define PROGRESS_MAX_WORKERS	64
+#define PROGRESS_BATCH		(1 << 16)
+
+struct progress_counter {
+	long flops;
+	char pad[64 - sizeof(long)];
+};
+
+struct progress {
+	struct progress_counter worker[PROGRESS_MAX_WORKERS];
+	int nworkers;
+	long expected;		/* Total flops of the work queued so far */
+};
+
+static struct progress *progress;
+static struct timespec progress_start;
+static __thread int progress_slot = -1;
+static __thread long progress_pending;
+
+/* Flops of a strassen multiply of size n, additions included */
+static long strassen_flops(int n)
+{
+	if (n == 2)
+		return 25;
+	return 7 * strassen_flops(n/2) + 18L * (n/2) * (n/2);
+}
+
+static void progress_flush(void)
+{
+	if (!progress || !progress_pending)
+		return;
+
+	if (progress_slot < 0) {
+		progress_slot = __atomic_fetch_add(&progress->nworkers, 1,
+						   __ATOMIC_RELAXED);
+		if (progress_slot >= PROGRESS_MAX_WORKERS)
+			progress_slot = PROGRESS_MAX_WORKERS - 1;
+	}
+
+	__atomic_fetch_add(&progress->worker[progress_slot].flops,
+			   progress_pending, __ATOMIC_RELAXED);
+	progress_pending = 0;
+}
+
+static inline void progress_add(long flops)
+{
+	progress_pending += flops;
+	if (progress_pending >= PROGRESS_BATCH)
+		progress_flush();
+}
+
+/* A forked worker gets its own counter */
+static void progress_fork_child(void)
+{
+	progress_slot = -1;
+	progress_pending = 0;
+}
+
+/* Account flops that are going to be done, for percent done and ETA */
+static void progress_expect(long flops)
+{
+	if (progress)
+		__atomic_fetch_add(&progress->expected, flops, __ATOMIC_RELAXED);
+}
+
+static void *progress_reporter(void *arg)
+{
+	sigset_t *set = arg;
+	struct timespec now, last;
+	long done, prev = 0, expected;
+	double elapsed, interval, rate;
+	int sig, w, nworkers;
+
+	last = progress_start;
+	for (;;) {
+		if (sigwait(set, &sig))
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		nworkers = __atomic_load_n(&progress->nworkers, __ATOMIC_RELAXED);
+		if (nworkers > PROGRESS_MAX_WORKERS)
+			nworkers = PROGRESS_MAX_WORKERS;
+
+		done = 0;
+		for (w = 0; w < nworkers; w++)
+			done += __atomic_load_n(&progress->worker[w].flops,
+						__ATOMIC_RELAXED);
+		expected = __atomic_load_n(&progress->expected, __ATOMIC_RELAXED);
+
+		elapsed = (now.tv_sec - progress_start.tv_sec) +
+			  (now.tv_nsec - progress_start.tv_nsec) / 1e9;
+		interval = (now.tv_sec - last.tv_sec) +
+			   (now.tv_nsec - last.tv_nsec) / 1e9;
+		rate = interval > 0 ? (done - prev) / interval : 0;
+		if (done > expected)
+			expected = done;
+
+		fprintf(stderr, "%.1f%% done, %ld of %ld flops in %.1fs, %.3f GFLOP/s",
+			expected ? 100.0 * done / expected : 0.0, done, expected,
+			elapsed, rate / 1e9);
+		if (rate > 0)
+			fprintf(stderr, ", ETA %.1fs", (expected - done) / rate);
+		fprintf(stderr, "\n");
+
+		for (w = 0; w < nworkers; w++)
+			fprintf(stderr, "\tworker %d: %ld flops\n", w,
+				__atomic_load_n(&progress->worker[w].flops,
+						__ATOMIC_RELAXED));
+
+		last = now;
+		prev = done;
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the SIGUSR1 reporter. Must run before any thread or worker process
+ * is created so that all of them inherit SIGUSR1 blocked and only the
+ * reporter takes it.
+ */
+void progress_init(void)
+{
+	static sigset_t set;
+	pthread_t tid;
+
+	progress = mmap(NULL, sizeof(*progress), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (progress == MAP_FAILED) {
+		progress = NULL;
+		return;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &progress_start);
+	if (pthread_create(&tid, NULL, progress_reporter, &set) == 0)
+		pthread_detach(tid);
+}
+
+/**
+ * strassen_split: build the operands of the seven strassen products.
+ * @a: matrix a
+ * @b: matrix b
+ * @n: number of row/column for a and b
+ * @X: returns left operand of M1..M7
+ * @Y: returns right operand of M1..M7
+ *
+ * Mk = X[k - 1] x Y[k - 1], each of them n/2 x n/2.
+ */
+void strassen_split(struct matrix a, struct matrix b, int n,
+		    struct matrix *X, struct matrix *Y)
 {
 	struct matrix A00, A01, A10, A11; /* Four quadrant of matrix a */
 	struct matrix B00, B01, B10, B11; /* Four quadrant of matrix b */
-	struct matrix M1, M2, M3, M4, M5, M6, M7;
+
+	A00.i = a.i;		A00.j = a.j;
+	copy_elems_to_quad(&A00, &a, n/2);
+
+	A01.i = a.i;		A01.j = a.j + (n/2);
+	copy_elems_to_quad(&A01, &a, n/2);
+
+	A10.i = a.i + (n/2);	A10.j = a.j;
+	copy_elems_to_quad(&A10, &a, n/2);
+
+	A11.i = a.i + (n/2);	A11.j = a.j + (n/2);
+	copy_elems_to_quad(&A11, &a, n/2);
+
+	B00.i = b.i;		B00.j = b.j;
+	copy_elems_to_quad(&B00, &b, n/2);
+
+	B01.i = b.i; 		B01.j = b.j + (n/2);
+	copy_elems_to_quad(&B01, &b, n/2);
+
+	B10.i = b.i + (n/2);	B10.j = b.j;
+	copy_elems_to_quad(&B10, &b, n/2);
+
+	B11.i = b.i + (n/2);	B11.j = b.j + (n/2);
+	copy_elems_to_quad(&B11, &b, n/2);
+
+	X[0] = add(A00, A11, n/2);	Y[0] = add(B00, B11, n/2);
+	X[1] = add(A10, A11, n/2);	Y[1] = B00;
+	X[2] = A00;			Y[2] = sub(B01, B11, n/2);
+	X[3] = A11;			Y[3] = sub(B10, B00, n/2);
+	X[4] = add(A00, A01, n/2);	Y[4] = B11;
+	X[5] = sub(A10, A00, n/2);	Y[5] = add(B00, B01, n/2);
+	X[6] = sub(A01, A11, n/2);	Y[6] = add(B10, B11, n/2);
+}
+
+/**
+ * strassen_combine: assemble c = a x b from the seven strassen products.
+ * @M: M1..M7 as returned for the operands of strassen_split()
+ * @n: number of row/column of the result
+ */
+struct matrix strassen_combine(struct matrix *M, int n)
+{
 	struct matrix Q1, Q2, Q3, Q4;
 	struct matrix res;
-	int r, c, i, j; 
+	int r, c, i, j;
+
+	Q1 = add(sub(add(M[0], M[3], n/2), M[4], n/2), M[6], n/2);
+	Q2 = add(M[2], M[4], n/2);
+	Q3 = add(M[1], M[3], n/2);
+	Q4 = add(add(sub(M[0], M[1], n/2), M[2], n/2), M[5], n/2);
+
+	res.i = res.j = 0;
+
+	for (r = 0, i = 0; r < n/2; r++, i++)
+		for (c = 0, j = 0; c < n/2; c++, j++)
+			res.m[r][c] = Q1.m[Q1.i + i][Q1.j + j];
+
+	for (r = 0, i = 0; r < n/2; r++, i++)
+		for (c = n/2, j = 0; c < n; c++, j++)
+			res.m[r][c] = Q2.m[Q2.i + i][Q2.j + j];
+
+	for (r = n/2, i = 0; r < n; r++, i++)
+		for (c = 0, j = 0; c < n/2; c++, j++)
+			res.m[r][c] = Q3.m[Q3.i + i][Q3.j + j];
+
+	for (r = n/2, i = 0; r < n; r++, i++)
+		for (c = n/2, j = 0; c < n; c++, j++)
+			res.m[r][c] = Q4.m[Q4.i + i][Q4.j + j];
+
+	return res;
+}
+
+/**
+ * strassen_matrix_multiply: strassen's algo for matrix multiplication.
+ * @m: structure holding a,b and c matrix where c = a x b
+ * @n: number of row/column for each matrix
+ */
+struct matrix strassen_matrix_multiply(struct matrix a, struct matrix b, int n)
+{
+	struct matrix X[7], Y[7]; /* Operands of M1..M7 */
+	struct matrix M[7];
+	int i, j, k;
 
 	if (n == 2) {
 		int m1, m2, m3, m4, m5, m6, m7;
@@ -279,144 +683,2449 @@ struct matrix strassen_matrix_multiply(struct matrix a, struct matrix b, int n)
 			print_debug("\n");
 		}
 
+		progress_add(25);
+
 		return c;
 	}
 
-	A00.i = a.i;		A00.j = a.j;
-	copy_elems_to_quad(&A00, &a, n/2);
+	strassen_split(a, b, n, X, Y);
+	progress_add(18L * (n/2) * (n/2));
 
-	A01.i = a.i;		A01.j = a.j + (n/2);
-	copy_elems_to_quad(&A01, &a, n/2);
+	for (k = 0; k < 7; k++) {
+		print_debug("\nCalculate M%d\n", k + 1);
+		M[k] = strassen_matrix_multiply(X[k], Y[k], n/2);
+	}
 
-	A10.i = a.i + (n/2);	A10.j = a.j;
-	copy_elems_to_quad(&A10, &a, n/2);
+	return strassen_combine(M, n);
+}
 
-	A11.i = a.i + (n/2);	A11.j = a.j + (n/2);
-	copy_elems_to_quad(&A11, &a, n/2);
+/*
+ * Distributed strassen (CAPS, communication-avoiding parallel strassen).
+ *
+ * The seven sub-products are farmed out to worker processes connected to
+ * the master through UNIX domain socket pairs. The recursion mixes two
+ * kind of steps:
+ *
+ *	BFS step: the seven sub-products are spread across the workers and
+ *		  all of them are in flight at the same time. Needs memory
+ *		  for the operands of all seven products.
+ *	DFS step: the sub-products are computed one after another and every
+ *		  one of them is split again across all the workers. Needs
+ *		  only the memory of one product at a time.
+ *
+ * As in CAPS, DFS steps are taken while the BFS expansion does not fit in
+ * the memory budget, then the rest of the recursion is done breadth first.
+ */
+struct caps_job {
+	int n;
+	struct matrix a;
+	struct matrix b;
+};
 
-	B00.i = b.i;		B00.j = b.j;
-	copy_elems_to_quad(&B00, &b, n/2);
+struct caps_worker {
+	pid_t pid;
+	int fd;
 
-	B01.i = b.i; 		B01.j = b.j + (n/2);
-	copy_elems_to_quad(&B01, &b, n/2);
+	/* Jobs of the current BFS steps, results in the same order */
+	struct caps_job *jobs;
+	struct matrix *res;
+	int njobs, nalloc;
+	int nsent, nrecv, nnext;
+};
 
-	B10.i = b.i + (n/2);	B10.j = b.j;
-	copy_elems_to_quad(&B10, &b, n/2);
+/*
+ * Jobs a worker holds without its result having been read back. Small
+ * enough that the worker's results always fit the socket buffer, so it
+ * never blocks writing one while the master is blocked writing a job.
+ */
+#define CAPS_WINDOW	4
 
-	B11.i = b.i + (n/2);	B11.j = b.j + (n/2);
-	copy_elems_to_quad(&B11, &b, n/2);
+static struct caps_worker *caps_workers;
+static int caps_nworkers;
+static size_t caps_mem_limit;	/* Bytes, 0 means use available memory */
 
-	print_debug("\nCalculate M1\n");
-	M1 = strassen_matrix_multiply(add(A00, A11, n/2), add(B00, B11, n/2), n/2);
+static void read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			printf("caps: read error on fd %d\n", fd);
+			exit(EXIT_FAILURE);
+		}
+		p += r;
+		len -= r;
+	}
+}
 
-	print_debug("\nCalculate M2\n");
-	M2 = strassen_matrix_multiply(add(A10, A11, n/2), B00, n/2);
+static void write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			printf("caps: write error on fd %d\n", fd);
+			exit(EXIT_FAILURE);
+		}
+		p += r;
+		len -= r;
+	}
+}
 
-	print_debug("\nCalculate M3\n");
-	M3 = strassen_matrix_multiply(A00, sub(B01, B11, n/2), n/2);
+/* Worker: multiply whatever comes in until the master closes the socket */
+static void caps_worker_loop(int fd)
+{
+	struct caps_job job;
+	struct matrix res;
+	ssize_t r;
 
-	print_debug("\nCalculate M4\n");
-	M4 = strassen_matrix_multiply(A11, sub(B10, B00, n/2), n/2);
+	for (;;) {
+		r = read(fd, &job, sizeof(job));
+		if (r == 0)
+			break;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			printf("caps: worker read error\n");
+			exit(EXIT_FAILURE);
+		}
+		if ((size_t)r < sizeof(job))
+			read_full(fd, (char *)&job + r, sizeof(job) - r);
 
-	print_debug("\nCalculate M5\n");
-	M5 = strassen_matrix_multiply(add(A00, A01, n/2), B11, n/2);
+		res = strassen_matrix_multiply(job.a, job.b, job.n);
+		progress_flush();
+		write_full(fd, &res, sizeof(res));
+	}
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
 
-	print_debug("\nCalculate M6\n");
-	M6 = strassen_matrix_multiply(sub(A10, A00, n/2), add(B00, B01, n/2), n/2);
+void caps_start_workers(int nworkers)
+{
+	int sv[2];
+	int w, k;
+	pid_t pid;
 
-	print_debug("\nCalculate M7\n");
-	M7 = strassen_matrix_multiply(sub(A01, A11, n/2), add(B10, B11, n/2), n/2);
+	caps_workers = calloc(nworkers, sizeof(*caps_workers));
+	if (!caps_workers) {
+		printf("caps: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
 
-	Q1 = add(sub(add(M1, M4, n/2), M5, n/2), M7, n/2);
-	Q2 = add(M3, M5, n/2);
-	Q3 = add(M2, M4, n/2);
-	Q4 = add(add(sub(M1, M2, n/2), M3, n/2), M6, n/2);
+	for (w = 0; w < nworkers; w++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			printf("caps: socketpair failed\n");
+			exit(EXIT_FAILURE);
+		}
 
-	for (r = 0, i = 0; r < n/2; r++, i++)
-		for (c = 0, j = 0; c < n/2; c++, j++)
-			res.m[r][c] = Q1.m[Q1.i + i][Q1.j + j];
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0) {
+			printf("caps: fork failed\n");
+			exit(EXIT_FAILURE);
+		}
 
-	for (r = 0, i = 0; r < n/2; r++, i++)
-		for (c = n/2, j = 0; c < n; c++, j++)
-			res.m[r][c] = Q2.m[Q2.i + i][Q2.j + j];
+		if (pid == 0) {
+			close(sv[0]);
+			for (k = 0; k < w; k++)
+				close(caps_workers[k].fd);
+			progress_fork_child();
+			caps_worker_loop(sv[1]);
+		}
 
-	for (r = n/2, i = 0; r < n; r++, i++)
-		for (c = 0, j = 0; c < n/2; c++, j++)
-			res.m[r][c] = Q3.m[Q3.i + i][Q3.j + j];
+		close(sv[1]);
+		caps_workers[w].pid = pid;
+		caps_workers[w].fd = sv[0];
+	}
+	caps_nworkers = nworkers;
+}
 
-	for (r = n/2, i = 0; r < n; r++, i++)
-		for (c = n/2, j = 0; c < n; c++, j++)
-			res.m[r][c] = Q4.m[Q4.i + i][Q4.j + j];
+void caps_stop_workers(void)
+{
+	int w;
+
+	for (w = 0; w < caps_nworkers; w++)
+		close(caps_workers[w].fd);
+	for (w = 0; w < caps_nworkers; w++) {
+		waitpid(caps_workers[w].pid, NULL, 0);
+		free(caps_workers[w].jobs);
+		free(caps_workers[w].res);
+	}
 
-	return res;
+	free(caps_workers);
+	caps_workers = NULL;
+	caps_nworkers = 0;
 }
 
-void read_from_file(struct matrix *m1, struct matrix *m2, int n)
+/* Workers [w, w + nw) are split in seven groups, group k gets [*first, +*cnt) */
+static void caps_group(int w, int nw, int k, int *first, int *cnt)
 {
-	int i, j;
-	FILE *fp;
-	int num_line = 0;
-	char line[1000];
-	char *token;
-
-	fp = fopen("a.txt", "r");
-	if (fp == NULL) {
-		printf("a.txt open error\n");
-		exit(EXIT_FAILURE);
+	if (nw < 7) {
+		*first = w + k % nw;
+		*cnt = 1;
+	} else {
+		*first = w + k * nw / 7;
+		*cnt = w + (k + 1) * nw / 7 - *first;
 	}
+}
 
-	/* Parse a.txt to read matrix A */
-	printf("Elements for matrix A\n");
-	i = 0;
-	m1->i = m1->j = 0;
-	while (fgets(line, 1000, fp) != NULL) {
-		j = 0;
-		token = strtok(line, " ");
+/* Memory needed to do the rest of the recursion breadth first */
+static size_t caps_bfs_footprint(int n, int nw)
+{
+	size_t bytes = 0;
+	int k, first, cnt;
 
-		while(token) {
-			m1->m[m1->i + i][m1->j + j] = atoi(token);
-			printf("%d ", m1->m[m1->i + i][m1->j + j]);
-			if (m1->m[m1->i + i][m1->j + j] < 0)
-				exit(EXIT_FAILURE);
-			token = strtok(NULL, " ");
-			if (++j == n)
-				break;
-		}
-		printf("\n");
-		if (++i == n)
-			break;
-	}
-	fclose(fp);
+	if (nw == 1 || n == 2)
+		return 3 * (size_t)n * n * sizeof(int);
 
-	fp = fopen("b.txt", "r");
-	if (fp == NULL) {
-		printf("fp open error\n");
-		exit(EXIT_FAILURE);
+	/* Operands of the seven products are live while they are computed */
+	bytes = 14 * (size_t)(n/2) * (n/2) * sizeof(int);
+	for (k = 0; k < 7; k++) {
+		caps_group(0, nw, k, &first, &cnt);
+		bytes += caps_bfs_footprint(n/2, cnt);
 	}
 
-	/* Parse b.txt to read matrix B */
-	printf("Elements for matrix B\n");
-	i = 0;
-	m2->i = m2->j = 0;
-	while (fgets(line, 1000, fp) != NULL) {
-		j = 0;
-		token = strtok(line, " ");
+	return bytes;
+}
 
-		while(token) {
-			m2->m[m2->i + i][m2->j + j] = atoi(token);
-			printf("%d ", m2->m[m2->i + i][m2->j + j]);
-			if (m2->m[m2->i + i][m2->j + j] < 0)
+/* Queue the BFS leaves on their workers, caps_bfs_exchange() runs them */
+static void caps_bfs_send(struct matrix a, struct matrix b, int n, int w, int nw)
+{
+	struct caps_worker *cw = &caps_workers[w];
+	struct matrix X[7], Y[7];
+	struct caps_job *jobs;
+	int k, first, cnt;
+
+	if (nw == 1 || n == 2) {
+		if (cw->njobs == cw->nalloc) {
+			cw->nalloc = cw->nalloc ? 2 * cw->nalloc : 8;
+			jobs = realloc(cw->jobs, cw->nalloc * sizeof(*jobs));
+			if (!jobs) {
+				printf("caps: out of memory\n");
 				exit(EXIT_FAILURE);
-			token = strtok(NULL, " ");
-			if (++j == n)
-				break;
+			}
+			cw->jobs = jobs;
 		}
-		printf("\n");
-		if (++i == n)
-			break;
+		cw->jobs[cw->njobs].n = n;
+		cw->jobs[cw->njobs].a = a;
+		cw->jobs[cw->njobs].b = b;
+		cw->njobs++;
+		return;
 	}
 
-	fclose(fp);
+	strassen_split(a, b, n, X, Y);
+	for (k = 0; k < 7; k++) {
+		caps_group(w, nw, k, &first, &cnt);
+		caps_bfs_send(X[k], Y[k], n/2, first, cnt);
+	}
+}
+
+/*
+ * Run the queued jobs: each worker is kept CAPS_WINDOW jobs ahead and
+ * results are read as poll() reports them, from any worker, so sending
+ * and receiving never wait on each other.
+ */
+static void caps_bfs_exchange(void)
+{
+	struct pollfd *pfd;
+	struct caps_worker *cw;
+	int *idx, np, w, k;
+
+	pfd = calloc(caps_nworkers, sizeof(*pfd));
+	idx = calloc(caps_nworkers, sizeof(*idx));
+	if (!pfd || !idx) {
+		printf("caps: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (w = 0; w < caps_nworkers; w++) {
+		cw = &caps_workers[w];
+		free(cw->res);
+		cw->res = calloc(cw->njobs ? cw->njobs : 1, sizeof(*cw->res));
+		if (!cw->res) {
+			printf("caps: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		cw->nsent = cw->nrecv = cw->nnext = 0;
+	}
+
+	for (;;) {
+		np = 0;
+		for (w = 0; w < caps_nworkers; w++) {
+			cw = &caps_workers[w];
+			while (cw->nsent < cw->njobs &&
+			       cw->nsent - cw->nrecv < CAPS_WINDOW) {
+				write_full(cw->fd, &cw->jobs[cw->nsent],
+					   sizeof(*cw->jobs));
+				cw->nsent++;
+			}
+			if (cw->nrecv < cw->nsent) {
+				pfd[np].fd = cw->fd;
+				pfd[np].events = POLLIN;
+				idx[np++] = w;
+			}
+		}
+		if (!np)
+			break;
+
+		if (poll(pfd, np, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("caps: poll failed\n");
+			exit(EXIT_FAILURE);
+		}
+		for (k = 0; k < np; k++) {
+			if (!pfd[k].revents)
+				continue;
+			cw = &caps_workers[idx[k]];
+			read_full(cw->fd, &cw->res[cw->nrecv], sizeof(*cw->res));
+			cw->nrecv++;
+		}
+	}
+
+	free(pfd);
+	free(idx);
+}
+
+/*
+ * Collect what caps_bfs_send() handed out. The traversal is the same, so
+ * results are taken from every worker in the order the jobs were queued.
+ */
+static struct matrix caps_bfs_recv(int n, int w, int nw)
+{
+	struct caps_worker *cw = &caps_workers[w];
+	struct matrix M[7];
+	int k, first, cnt;
+
+	if (nw == 1 || n == 2)
+		return cw->res[cw->nnext++];
+
+	for (k = 0; k < 7; k++) {
+		caps_group(w, nw, k, &first, &cnt);
+		M[k] = caps_bfs_recv(n/2, first, cnt);
+	}
+	progress_add(18L * (n/2) * (n/2));
+
+	return strassen_combine(M, n);
+}
+
+/**
+ * caps_matrix_multiply: strassen's algo spread over the worker processes.
+ * @a: matrix a
+ * @b: matrix b
+ * @n: number of row/column for each matrix
+ *
+ * caps_start_workers() must have been called before.
+ */
+struct matrix caps_matrix_multiply(struct matrix a, struct matrix b, int n)
+{
+	struct matrix X[7], Y[7];
+	struct matrix M[7];
+	size_t limit = caps_mem_limit;
+	int k;
+
+	if (!limit)
+		limit = (size_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+	if (n > 2 && caps_bfs_footprint(n, caps_nworkers) > limit) {
+		print_debug("caps: DFS step n = %d\n", n);
+		strassen_split(a, b, n, X, Y);
+		for (k = 0; k < 7; k++)
+			M[k] = caps_matrix_multiply(X[k], Y[k], n/2);
+		progress_add(18L * (n/2) * (n/2));
+		return strassen_combine(M, n);
+	}
+
+	print_debug("caps: BFS steps n = %d\n", n);
+	for (k = 0; k < caps_nworkers; k++)
+		caps_workers[k].njobs = 0;
+	caps_bfs_send(a, b, n, 0, caps_nworkers);
+	caps_bfs_exchange();
+	return caps_bfs_recv(n, 0, caps_nworkers);
+}
+
+/*
+ * SUMMA: classical multiplication over a q x q grid of worker processes.
+ *
+ * Process (i, j) owns block A(i, j), B(i, j) and C(i, j), each n/q x n/q.
+ * At step k process (i, k) broadcasts A(i, k) along grid row i, process
+ * (k, j) broadcasts B(k, j) along grid column j and every process does
+ * C(i, j) += A(i, k) x B(k, j).
+ *
+ * Broadcasts go through two panel slots per grid row/column in shared
+ * memory. While everybody multiplies the panels of step k, the owners of
+ * the step k + 1 panels already publish them in the other slot, so the
+ * communication of the next panel overlaps the local multiplication and
+ * a single barrier per step is enough.
+ */
+struct summa_shm {
+	pthread_barrier_t barrier;
+	int apanel[2][NUM_ELEMS][NUM_ELEMS * NUM_ELEMS];	/* Per grid row */
+	int bpanel[2][NUM_ELEMS][NUM_ELEMS * NUM_ELEMS];	/* Per grid col */
+	int c[NUM_ELEMS][NUM_ELEMS];
+};
+
+/*
+ * c += a x b, a is rows x inner, b inner x cols, all row major. With
+ * checked every product and sum goes through check_overflow().
+ */
+static void classical_block_multiply(int *c, const int *a, const int *b,
+				     int rows, int inner, int cols,
+				     bool checked)
+{
+	int r, col, k, p;
+
+	for (r = 0; r < rows; r++)
+		for (k = 0; k < inner; k++)
+			for (col = 0; col < cols; col++) {
+				if (checked)
+					check_overflow(a[r * inner + k],
+						       b[k * cols + col],
+						       false, true);
+				p = a[r * inner + k] * b[k * cols + col];
+				if (checked)
+					check_overflow(c[r * cols + col], p,
+						       true, false);
+				c[r * cols + col] += p;
+			}
+}
+
+static void summa_get_block(int *dst, struct matrix *m, int bi, int bj, int blk)
+{
+	int r, c;
+
+	for (r = 0; r < blk; r++)
+		for (c = 0; c < blk; c++)
+			dst[r * blk + c] = m->m[m->i + bi * blk + r][m->j + bj * blk + c];
+}
+
+static void summa_publish(struct summa_shm *shm, int step, int i, int j,
+			  int *a, int *b, int blk)
+{
+	/* A(i, j) goes to grid row i, B(i, j) to grid column j */
+	if (j == step)
+		memcpy(shm->apanel[step % 2][i], a, blk * blk * sizeof(int));
+	if (i == step)
+		memcpy(shm->bpanel[step % 2][j], b, blk * blk * sizeof(int));
+}
+
+static void summa_worker(struct summa_shm *shm, struct matrix *a,
+			 struct matrix *b, int i, int j, int q, int blk)
+{
+	int la[NUM_ELEMS * NUM_ELEMS], lb[NUM_ELEMS * NUM_ELEMS];
+	int lc[NUM_ELEMS * NUM_ELEMS];
+	int k, r, c;
+
+	summa_get_block(la, a, i, j, blk);
+	summa_get_block(lb, b, i, j, blk);
+	memset(lc, 0, sizeof(lc));
+
+	summa_publish(shm, 0, i, j, la, lb, blk);
+	pthread_barrier_wait(&shm->barrier);
+
+	for (k = 0; k < q; k++) {
+		if (k + 1 < q)
+			summa_publish(shm, k + 1, i, j, la, lb, blk);
+
+		classical_block_multiply(lc, shm->apanel[k % 2][i],
+					 shm->bpanel[k % 2][j], blk, blk, blk,
+					 false);
+		progress_add(2L * blk * blk * blk);
+
+		pthread_barrier_wait(&shm->barrier);
+	}
+
+	for (r = 0; r < blk; r++)
+		for (c = 0; c < blk; c++)
+			shm->c[i * blk + r][j * blk + c] = lc[r * blk + c];
+}
+
+/**
+ * summa_matrix_multiply: classical multiplication over a process grid.
+ * @a: matrix a
+ * @b: matrix b
+ * @n: number of row/column for each matrix
+ * @nprocs: number of worker processes, must be a square q x q with q | n
+ */
+struct matrix summa_matrix_multiply(struct matrix a, struct matrix b, int n,
+				    int nprocs)
+{
+	struct summa_shm *shm;
+	pthread_barrierattr_t attr;
+	struct matrix res;
+	pid_t *pids;
+	int q, blk, p, r, c;
+
+	for (q = 1; q * q < nprocs; q++)
+		;
+	if (q * q != nprocs || n % q) {
+		printf("summa: %d processes is not a square grid dividing n = %d\n",
+		       nprocs, n);
+		exit(EXIT_FAILURE);
+	}
+	blk = n / q;
+
+	shm = huge_alloc(sizeof(*shm), true);
+	pids = calloc(nprocs, sizeof(*pids));
+	if (!shm || !pids) {
+		printf("summa: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	huge_prefault(shm, sizeof(*shm));
+
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&shm->barrier, &attr, nprocs);
+	pthread_barrierattr_destroy(&attr);
+
+	fflush(stdout);
+	for (p = 0; p < nprocs; p++) {
+		pids[p] = fork();
+		if (pids[p] < 0) {
+			printf("summa: fork failed\n");
+			exit(EXIT_FAILURE);
+		}
+		if (pids[p] == 0) {
+			progress_fork_child();
+			summa_worker(shm, &a, &b, p / q, p % q, q, blk);
+			progress_flush();
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	for (p = 0; p < nprocs; p++)
+		waitpid(pids[p], NULL, 0);
+
+	res.i = res.j = 0;
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++)
+			res.m[r][c] = shm->c[r][c];
+
+	pthread_barrier_destroy(&shm->barrier);
+	huge_free(shm, sizeof(*shm), true);
+	free(pids);
+
+	return res;
+}
+
+/*
+ * Incremental product: keeps c = a x b up to date while a and b change.
+ *
+ * A changed row of a only changes the same row of c, a changed column of
+ * b only the same column of c, so instead of multiplying again:
+ *
+ *	a row r += d:		c row r += d x b		(GEMV, n^2)
+ *	b col j += d:		c col j += a x d		(GEMV, n^2)
+ *	a[r][k] += d:		c row r += d * b row k		(n)
+ *	b[k][j] += d:		c col j += d * a col k		(n)
+ *
+ * When a batch of deltas costs more than a full strassen multiply, the
+ * deltas are applied to a and b and c is recomputed from scratch.
+ */
+enum incr_kind {
+	INCR_A_ROW,
+	INCR_B_COL,
+	INCR_A_ELEM,
+	INCR_B_ELEM,
+};
+
+struct incr_delta {
+	enum incr_kind kind;
+	int r, c;		/* Row for INCR_A_ROW, col for INCR_B_COL */
+	int v[NUM_ELEMS];	/* New row/col, or new element in v[0] */
+};
+
+struct incr_product {
+	struct matrix a, b, c;	/* Kept with i = j = 0 */
+	int n;
+	int full_recomputes;
+};
+
+static void matrix_rebase(struct matrix *dst, struct matrix *src, int n)
+{
+	int r, c;
+
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++)
+			dst->m[r][c] = src->m[src->i + r][src->j + c];
+	dst->i = dst->j = 0;
+}
+
+/* c[r][col] += x * y with the usual overflow checks */
+static inline void incr_madd(int *c, int x, int y)
+{
+	check_overflow(x, y, false, true);
+	check_overflow(*c, x * y, true, false);
+	*c += x * y;
+}
+
+/**
+ * incr_init: start tracking c = a x b.
+ * @ip: incremental product
+ * @a: matrix a
+ * @b: matrix b
+ * @c: a x b, already computed
+ * @n: number of row/column for each matrix
+ */
+void incr_init(struct incr_product *ip, struct matrix *a, struct matrix *b,
+	       struct matrix *c, int n)
+{
+	matrix_rebase(&ip->a, a, n);
+	matrix_rebase(&ip->b, b, n);
+	matrix_rebase(&ip->c, c, n);
+	ip->n = n;
+	ip->full_recomputes = 0;
+}
+
+/* Flops of applying d, a multiply and an add per updated element */
+static long incr_cost(struct incr_delta *d, int n)
+{
+	if (d->kind == INCR_A_ROW || d->kind == INCR_B_COL)
+		return 2L * n * n;
+	return 2L * n;
+}
+
+/* Update a/b only, c is recomputed by the caller */
+static void incr_set_operand(struct incr_product *ip, struct incr_delta *d)
+{
+	int k;
+
+	switch (d->kind) {
+	case INCR_A_ROW:
+		for (k = 0; k < ip->n; k++)
+			ip->a.m[d->r][k] = d->v[k];
+		break;
+	case INCR_B_COL:
+		for (k = 0; k < ip->n; k++)
+			ip->b.m[k][d->c] = d->v[k];
+		break;
+	case INCR_A_ELEM:
+		ip->a.m[d->r][d->c] = d->v[0];
+		break;
+	case INCR_B_ELEM:
+		ip->b.m[d->r][d->c] = d->v[0];
+		break;
+	}
+}
+
+static void incr_update(struct incr_product *ip, struct incr_delta *d)
+{
+	struct matrix *a = &ip->a, *b = &ip->b, *c = &ip->c;
+	int n = ip->n;
+	int k, x, dv;
+
+	switch (d->kind) {
+	case INCR_A_ROW:
+		for (k = 0; k < n; k++) {
+			dv = d->v[k] - a->m[d->r][k];
+			if (!dv)
+				continue;
+			for (x = 0; x < n; x++)
+				incr_madd(&c->m[d->r][x], dv, b->m[k][x]);
+		}
+		break;
+	case INCR_B_COL:
+		for (k = 0; k < n; k++) {
+			dv = d->v[k] - b->m[k][d->c];
+			if (!dv)
+				continue;
+			for (x = 0; x < n; x++)
+				incr_madd(&c->m[x][d->c], a->m[x][k], dv);
+		}
+		break;
+	case INCR_A_ELEM:
+		dv = d->v[0] - a->m[d->r][d->c];
+		for (x = 0; x < n; x++)
+			incr_madd(&c->m[d->r][x], dv, b->m[d->c][x]);
+		break;
+	case INCR_B_ELEM:
+		dv = d->v[0] - b->m[d->r][d->c];
+		for (x = 0; x < n; x++)
+			incr_madd(&c->m[x][d->c], a->m[x][d->r], dv);
+		break;
+	}
+
+	incr_set_operand(ip, d);
+}
+
+/**
+ * incr_apply: apply a batch of deltas to a and b and bring c up to date.
+ * @ip: incremental product
+ * @deltas: deltas, applied in order
+ * @count: number of deltas
+ */
+void incr_apply(struct incr_product *ip, struct incr_delta *deltas, int count)
+{
+	long cost = 0;
+	int d;
+
+	for (d = 0; d < count; d++)
+		cost += incr_cost(&deltas[d], ip->n);
+
+	if (ip->n > 2 && cost >= strassen_flops(ip->n)) {
+		for (d = 0; d < count; d++)
+			incr_set_operand(ip, &deltas[d]);
+		ip->c = strassen_matrix_multiply(ip->a, ip->b, ip->n);
+		matrix_rebase(&ip->c, &ip->c, ip->n);
+		ip->full_recomputes++;
+		return;
+	}
+
+	for (d = 0; d < count; d++)
+		incr_update(ip, &deltas[d]);
+}
+
+/*
+ * Parse deltas, one per line:
+ *	arow <r> <v0> ... <vn-1>
+ *	bcol <c> <v0> ... <vn-1>
+ *	a <r> <c> <v>
+ *	b <r> <c> <v>
+ *
+ * Returns the number of deltas, -1 on error. *deltas must be freed.
+ */
+int incr_read_deltas(const char *path, int n, struct incr_delta **deltas)
+{
+	struct incr_delta *d = NULL, *tmp;
+	int count = 0, alloc = 0, k, nvals;
+	char line[1000];
+	char *token, *save;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("%s open error\n", path);
+		return -1;
+	}
+
+	while (fgets(line, 1000, fp) != NULL) {
+		token = strtok_r(line, " \n", &save);
+		if (!token)
+			continue;
+
+		if (count == alloc) {
+			alloc = alloc ? 2 * alloc : 16;
+			tmp = realloc(d, alloc * sizeof(*d));
+			if (!tmp)
+				goto err;
+			d = tmp;
+		}
+		memset(&d[count], 0, sizeof(*d));
+
+		if (!strcmp(token, "arow")) {
+			d[count].kind = INCR_A_ROW;
+			nvals = n;
+		} else if (!strcmp(token, "bcol")) {
+			d[count].kind = INCR_B_COL;
+			nvals = n;
+		} else if (!strcmp(token, "a")) {
+			d[count].kind = INCR_A_ELEM;
+			nvals = 1;
+		} else if (!strcmp(token, "b")) {
+			d[count].kind = INCR_B_ELEM;
+			nvals = 1;
+		} else {
+			printf("%s: unknown delta %s\n", path, token);
+			goto err;
+		}
+
+		token = strtok_r(NULL, " \n", &save);
+		if (!token)
+			goto bad;
+		if (d[count].kind == INCR_B_COL)
+			d[count].c = atoi(token);
+		else
+			d[count].r = atoi(token);
+
+		if (nvals == 1) {
+			token = strtok_r(NULL, " \n", &save);
+			if (!token)
+				goto bad;
+			d[count].c = atoi(token);
+		}
+
+		for (k = 0; k < nvals; k++) {
+			token = strtok_r(NULL, " \n", &save);
+			if (!token)
+				goto bad;
+			d[count].v[k] = atoi(token);
+		}
+
+		if (d[count].r < 0 || d[count].r >= n ||
+		    d[count].c < 0 || d[count].c >= n)
+			goto bad;
+		count++;
+	}
+
+	fclose(fp);
+	*deltas = d;
+	return count;
+
+bad:
+	printf("%s: bad delta on line %d\n", path, count + 1);
+err:
+	fclose(fp);
+	free(d);
+	return -1;
+}
+
+/*
+ * Approximate multiplication with a CountSketch.
+ *
+ * S is a s x n matrix with a single +1/-1 per column, at a random row.
+ * E[S^T S] = I, so c ~ (a S^T)(S b): sketching a and b costs n^2 each and
+ * the reduced n x s x n product goes through classical_block_multiply().
+ * S has integer entries, so the sketched operands stay int, and every sum
+ * and product is overflow checked like the exact paths.
+ *
+ * APPROX_REPS independent sketches are averaged. Their spread gives the
+ * error estimate: the squared error of the mean is estimated by the sample
+ * variance over APPROX_REPS, summed over the elements, relative to the
+ * squared norm of the mean. Unlike the worst case bound
+ * (|a|^2 |b|^2 + |ab|^2) / s it follows the data and goes to 0 for inputs
+ * the sketch reproduces exactly. s is doubled until the estimate is within
+ * eps. A round costs APPROX_REPS * 2 n^2 s flops, so the doubling stops
+ * as soon as the next round would take the rounds done past the flops of
+ * an exact strassen product, and that product is returned instead.
+ */
+#define APPROX_REPS	4
+
+/**
+ * approx_matrix_multiply: c ~ a x b within a relative error.
+ * @a: matrix a
+ * @b: matrix b
+ * @n: number of row/column for each matrix
+ * @eps: relative (Frobenius) error allowed
+ * @err: returns the estimated relative error
+ * @sketch: returns the sketch size used, n for an exact product
+ */
+struct matrix approx_matrix_multiply(struct matrix a, struct matrix b, int n,
+				     double eps, double *err, int *sketch)
+{
+	int la[NUM_ELEMS * NUM_ELEMS], lb[NUM_ELEMS * NUM_ELEMS];
+	int sa[NUM_ELEMS * NUM_ELEMS], sb[NUM_ELEMS * NUM_ELEMS];
+	int lc[NUM_ELEMS * NUM_ELEMS];
+	double sum[NUM_ELEMS * NUM_ELEMS], sum2[NUM_ELEMS * NUM_ELEMS];
+	int bucket[NUM_ELEMS], sign[NUM_ELEMS];
+	double mean, var, fc;
+	long spent = 0, round;
+	struct matrix res;
+	int s, r, c, k, rep, x;
+
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++) {
+			la[r * n + c] = a.m[a.i + r][a.j + c];
+			lb[r * n + c] = b.m[b.i + r][b.j + c];
+		}
+
+	for (s = 1; s < n; s *= 2) {
+		/* Sketching no longer pays, multiply exactly */
+		round = APPROX_REPS * 2L * n * s * n;
+		if (spent + round > strassen_flops(n)) {
+			s = n;
+			break;
+		}
+		spent += round;
+
+		/* The total isn't known up front, it grows with s */
+		progress_expect(round);
+		memset(sum, 0, n * n * sizeof(double));
+		memset(sum2, 0, n * n * sizeof(double));
+
+		for (rep = 0; rep < APPROX_REPS; rep++) {
+			for (k = 0; k < n; k++) {
+				bucket[k] = rand() % s;
+				sign[k] = rand() % 2 ? 1 : -1;
+			}
+
+			/* sa = a S^T (n x s), sb = S b (s x n) */
+			memset(sa, 0, n * s * sizeof(int));
+			memset(sb, 0, s * n * sizeof(int));
+			for (k = 0; k < n; k++)
+				for (r = 0; r < n; r++) {
+					x = sign[k] * la[r * n + k];
+					check_overflow(sa[r * s + bucket[k]], x,
+						       true, false);
+					sa[r * s + bucket[k]] += x;
+					x = sign[k] * lb[k * n + r];
+					check_overflow(sb[bucket[k] * n + r], x,
+						       true, false);
+					sb[bucket[k] * n + r] += x;
+				}
+
+			memset(lc, 0, n * n * sizeof(int));
+			classical_block_multiply(lc, sa, sb, n, s, n, true);
+			progress_add(2L * n * s * n);
+			for (k = 0; k < n * n; k++) {
+				sum[k] += lc[k];
+				sum2[k] += (double)lc[k] * lc[k];
+			}
+		}
+
+		/* Variance of the mean of APPROX_REPS sketches, |mean|^2 */
+		var = fc = 0;
+		for (k = 0; k < n * n; k++) {
+			mean = sum[k] / APPROX_REPS;
+			var += (sum2[k] - sum[k] * mean) /
+			       (APPROX_REPS - 1) / APPROX_REPS;
+			fc += mean * mean;
+		}
+		progress_flush();
+		if (var < 0)
+			var = 0;
+		*err = fc ? sqrt(var / fc) : (var ? 1 : 0);
+		if (*err <= eps)
+			break;
+	}
+
+	if (s >= n) {
+		*err = 0;
+		*sketch = n;
+		progress_expect(strassen_flops(n));
+		res = strassen_matrix_multiply(a, b, n);
+		progress_flush();
+		return res;
+	}
+
+	*sketch = s;
+	res.i = res.j = 0;
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++)
+			res.m[r][c] = lround(sum[r * n + c] / APPROX_REPS);
+
+	return res;
+}
+
+/**
+ * read_matrix_file: parse a n x n matrix from a text file.
+ * @path: file holding one matrix row per line, elements separated by space
+ * @m: returns the matrix
+ * @n: number of row/column to read
+ * @verbose: print the elements while parsing
+ *
+ * Returns 0 on success, -1 if the file can't be opened or has a -ve element.
+ */
+int read_matrix_file(const char *path, struct matrix *m, int n, bool verbose)
+{
+	int i, j;
+	FILE *fp;
+	char line[1000];
+	char *token, *save;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("%s open error\n", path);
+		return -1;
+	}
+
+	i = 0;
+	m->i = m->j = 0;
+	while (fgets(line, 1000, fp) != NULL) {
+		j = 0;
+		token = strtok_r(line, " ", &save);
+
+		while(token) {
+			m->m[m->i + i][m->j + j] = atoi(token);
+			if (verbose)
+				printf("%d ", m->m[m->i + i][m->j + j]);
+			if (m->m[m->i + i][m->j + j] < 0) {
+				fclose(fp);
+				return -1;
+			}
+			token = strtok_r(NULL, " ", &save);
+			if (++j == n)
+				break;
+		}
+		if (verbose)
+			printf("\n");
+		if (++i == n)
+			break;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/* Write a n x n matrix in the format read_matrix_file() parses */
+int write_matrix_file(const char *path, struct matrix *m, int n)
+{
+	int i, j;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("%s open error\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++)
+			fprintf(fp, "%d ", m->m[m->i + i][m->j + j]);
+		fprintf(fp, "\n");
+	}
+
+	return fclose(fp) ? -1 : 0;
+}
+
+void read_from_file(struct matrix *m1, struct matrix *m2, int n)
+{
+	/* Parse a.txt to read matrix A */
+	printf("Elements for matrix A\n");
+	if (read_matrix_file("a.txt", m1, n, true))
+		exit(EXIT_FAILURE);
+
+	/* Parse b.txt to read matrix B */
+	printf("Elements for matrix B\n");
+	if (read_matrix_file("b.txt", m2, n, true))
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * Binary matrix format: struct smat_header followed by n x n int32
+ * elements in row major order, native endianness.
+ */
+#define SMAT_MAGIC	"SMAT"
+#define SMAT_VERSION	1
+
+struct smat_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n;
+	uint32_t elem_size;
+};
+
+/*
+ * Result cache: results are stored in the binary matrix format in a
+ * directory, under the XXH64 hash of A, B, the element type and the
+ * algorithm. Hits are mmap'd back. The file mtime is refreshed on every
+ * hit and the least recently used results are evicted when the directory
+ * grows above the size cap.
+ */
+static const char *cache_dir;
+static size_t cache_max_bytes;	/* 0 means no cap */
+
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = xxh_rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* XXH64 of len bytes at data */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h, v[4], k;
+	uint32_t k32;
+
+	if (len >= 32) {
+		v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v[1] = seed + XXH_PRIME64_2;
+		v[2] = seed;
+		v[3] = seed - XXH_PRIME64_1;
+		do {
+			for (k32 = 0; k32 < 4; k32++, p += 8) {
+				memcpy(&k, p, 8);
+				v[k32] = xxh_round(v[k32], k);
+			}
+		} while (p + 32 <= end);
+
+		h = xxh_rotl64(v[0], 1) + xxh_rotl64(v[1], 7) +
+		    xxh_rotl64(v[2], 12) + xxh_rotl64(v[3], 18);
+		for (k32 = 0; k32 < 4; k32++)
+			h = xxh_merge_round(h, v[k32]);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		memcpy(&k, p, 8);
+		h ^= xxh_round(0, k);
+		h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		memcpy(&k32, p, 4);
+		h ^= (uint64_t)k32 * XXH_PRIME64_1;
+		h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/* Hash of the n x n elements of a and b, prefixed with tag */
+uint64_t matrix_pair_hash(struct matrix *a, struct matrix *b, int n,
+			  const char *tag)
+{
+	int32_t elems[2 * NUM_ELEMS * NUM_ELEMS];
+	uint64_t h;
+	int r, c;
+
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++) {
+			elems[r * n + c] = a->m[a->i + r][a->j + c];
+			elems[n * n + r * n + c] = b->m[b->i + r][b->j + c];
+		}
+
+	h = xxh64(tag, strlen(tag), 0);
+	return xxh64(elems, 2 * n * n * sizeof(int32_t), h);
+}
+
+/* Cache file of a x b computed with algo */
+static void result_cache_path(char *path, size_t len, struct matrix *a,
+			      struct matrix *b, int n, const char *algo)
+{
+	char tag[64];
+	uint64_t h;
+
+	snprintf(tag, sizeof(tag), "int32:%s:%d", algo, n);
+	h = matrix_pair_hash(a, b, n, tag);
+
+	snprintf(path, len, "%s/%016llx.smat", cache_dir, (unsigned long long)h);
+}
+
+/**
+ * smat_map: mmap a binary matrix file.
+ * @path: file to map
+ * @n: expected number of row/column
+ * @len: returns the length of the mapping
+ *
+ * Returns the mapping, elements follow the header, or NULL if the file is
+ * missing or is not a n x n binary matrix. Unmap with munmap(map, *len).
+ */
+struct smat_header *smat_map(const char *path, int n, size_t *len)
+{
+	struct smat_header *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	*len = sizeof(*hdr) + (size_t)n * n * sizeof(int32_t);
+	if (fstat(fd, &st) || (size_t)st.st_size != *len) {
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return NULL;
+
+	if (memcmp(hdr->magic, SMAT_MAGIC, 4) || hdr->version != SMAT_VERSION ||
+	    hdr->n != (uint32_t)n || hdr->elem_size != sizeof(int32_t)) {
+		munmap(hdr, *len);
+		return NULL;
+	}
+
+	return hdr;
+}
+
+/* Write m in the binary matrix format, atomically replacing path */
+int smat_write(const char *path, struct matrix *m, int n)
+{
+	static int seq;
+	struct smat_header hdr;
+	char tmp[PATH_MAX];
+	int32_t row[NUM_ELEMS];
+	int fd, r, c;
+	bool ok = true;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", path, (int)getpid(),
+		 __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	memcpy(hdr.magic, SMAT_MAGIC, 4);
+	hdr.version = SMAT_VERSION;
+	hdr.n = n;
+	hdr.elem_size = sizeof(int32_t);
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+
+	for (r = 0; ok && r < n; r++) {
+		for (c = 0; c < n; c++)
+			row[c] = m->m[m->i + r][m->j + c];
+		ok = write(fd, row, n * sizeof(int32_t)) == (ssize_t)(n * sizeof(int32_t));
+	}
+
+	if (close(fd) || !ok || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * result_cache_get: look a product up in the result cache.
+ * @a: matrix a
+ * @b: matrix b
+ * @n: number of row/column for each matrix
+ * @algo: algorithm the result is computed with
+ * @res: returns a x b on a hit
+ *
+ * Returns true on a hit.
+ */
+bool result_cache_get(struct matrix *a, struct matrix *b, int n,
+		      const char *algo, struct matrix *res)
+{
+	struct smat_header *hdr;
+	char path[PATH_MAX];
+	const int32_t *elems;
+	size_t len;
+	int r, c;
+
+	result_cache_path(path, sizeof(path), a, b, n, algo);
+	hdr = smat_map(path, n, &len);
+	if (!hdr)
+		return false;
+
+	elems = (const int32_t *)(hdr + 1);
+	res->i = res->j = 0;
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++)
+			res->m[r][c] = elems[r * n + c];
+	munmap(hdr, len);
+
+	/* Most recently used */
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	return true;
+}
+
+struct cache_entry {
+	char name[NAME_MAX + 1];
+	struct timespec mtime;
+	off_t size;
+};
+
+static int cache_entry_cmp(const void *x, const void *y)
+{
+	const struct cache_entry *e1 = x, *e2 = y;
+
+	if (e1->mtime.tv_sec != e2->mtime.tv_sec)
+		return e1->mtime.tv_sec < e2->mtime.tv_sec ? -1 : 1;
+	if (e1->mtime.tv_nsec != e2->mtime.tv_nsec)
+		return e1->mtime.tv_nsec < e2->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Drop least recently used results until the cache fits cache_max_bytes */
+static void result_cache_evict(void)
+{
+	struct cache_entry *entries = NULL, *tmp;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	size_t nentries = 0, alloc = 0, e, total = 0;
+	size_t namelen;
+	DIR *dir;
+
+	dir = opendir(cache_dir);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		namelen = strlen(de->d_name);
+		if (namelen < 5 || strcmp(de->d_name + namelen - 5, ".smat"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+		if (stat(path, &st))
+			continue;
+
+		if (nentries == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (!tmp)
+				break;
+			entries = tmp;
+		}
+		strcpy(entries[nentries].name, de->d_name);
+		entries[nentries].mtime = st.st_mtim;
+		entries[nentries].size = st.st_size;
+		total += st.st_size;
+		nentries++;
+	}
+	closedir(dir);
+
+	qsort(entries, nentries, sizeof(*entries), cache_entry_cmp);
+	for (e = 0; e < nentries && total > cache_max_bytes; e++) {
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[e].name);
+		if (!unlink(path))
+			total -= entries[e].size;
+	}
+
+	free(entries);
+}
+
+/* Store a x b = res computed with algo in the result cache */
+void result_cache_put(struct matrix *a, struct matrix *b, int n,
+		      const char *algo, struct matrix *res)
+{
+	char path[PATH_MAX];
+
+	result_cache_path(path, sizeof(path), a, b, n, algo);
+	if (smat_write(path, res, n)) {
+		printf("cache: can't store %s\n", path);
+		return;
+	}
+
+	if (cache_max_bytes)
+		result_cache_evict();
+}
+
+/*
+ * Checkpoint and resume.
+ *
+ * The seven products of the top level strassen step are the unit of
+ * work: every time one of them completes, the finished products and the
+ * mask of which ones are done are written to the checkpoint file. A run
+ * started with --resume on the same inputs only computes the missing
+ * products. SIGINT/SIGTERM let the product in progress finish, flush a
+ * last checkpoint and exit.
+ */
+#define CKPT_MAGIC	"SCKP"
+#define CKPT_VERSION	1
+
+struct ckpt_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n;
+	uint32_t done;		/* Bit k set when M(k + 1) is in the file */
+	uint64_t inputs;	/* matrix_pair_hash() of a and b */
+};
+
+struct ckpt_file {
+	struct ckpt_header hdr;
+	struct matrix M[7];
+};
+
+static volatile sig_atomic_t ckpt_signal;
+
+static void ckpt_signal_handler(int sig)
+{
+	ckpt_signal = sig;
+}
+
+/* Make a rename into the directory holding path durable */
+static int ckpt_sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int fd, ret;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+
+	return ret;
+}
+
+static int ckpt_write(const char *path, struct ckpt_file *ck)
+{
+	char tmp[PATH_MAX];
+	int fd;
+	bool ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	/* The checkpoint must survive the node going away, not just us */
+	ok = write(fd, ck, sizeof(*ck)) == sizeof(*ck) && !fdatasync(fd);
+	if (close(fd) || !ok || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	/* And so must the rename */
+	return ckpt_sync_dir(path);
+}
+
+static bool ckpt_read(const char *path, struct ckpt_file *ck, int n,
+		      uint64_t inputs)
+{
+	bool ok;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ok = read(fd, ck, sizeof(*ck)) == sizeof(*ck);
+	close(fd);
+
+	return ok && !memcmp(ck->hdr.magic, CKPT_MAGIC, 4) &&
+	       ck->hdr.version == CKPT_VERSION && ck->hdr.n == (uint32_t)n &&
+	       ck->hdr.inputs == inputs;
+}
+
+/**
+ * checkpointed_matrix_multiply: strassen's algo with checkpoint/resume.
+ * @a: matrix a
+ * @b: matrix b
+ * @n: number of row/column for each matrix
+ * @path: checkpoint file, removed once the product is complete
+ * @resume: continue from the checkpoint in path if it matches a and b
+ */
+struct matrix checkpointed_matrix_multiply(struct matrix a, struct matrix b,
+					   int n, const char *path, bool resume)
+{
+	struct sigaction sa, old_int, old_term;
+	struct matrix X[7], Y[7];
+	struct ckpt_file ck;
+	struct matrix res;
+	uint64_t inputs;
+	int k, done = 0;
+
+	if (n == 2)
+		return strassen_matrix_multiply(a, b, n);
+
+	inputs = matrix_pair_hash(&a, &b, n, "ckpt");
+	if (resume && ckpt_read(path, &ck, n, inputs)) {
+		for (k = 0; k < 7; k++)
+			done += (ck.hdr.done >> k) & 1;
+		printf("Resuming from %s: %d of 7 products done\n", path, done);
+		/* Not computed by this run */
+		progress_expect(-done * strassen_flops(n/2));
+	} else {
+		if (resume)
+			printf("No usable checkpoint in %s, starting over\n", path);
+		memset(&ck, 0, sizeof(ck));
+		memcpy(ck.hdr.magic, CKPT_MAGIC, 4);
+		ck.hdr.version = CKPT_VERSION;
+		ck.hdr.n = n;
+		ck.hdr.inputs = inputs;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = ckpt_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	strassen_split(a, b, n, X, Y);
+	progress_add(18L * (n/2) * (n/2));
+	for (k = 0; k < 7; k++) {
+		if (ck.hdr.done & (1U << k))
+			continue;
+
+		ck.M[k] = strassen_matrix_multiply(X[k], Y[k], n/2);
+		ck.hdr.done |= 1U << k;
+		progress_flush();
+
+		if (ckpt_write(path, &ck))
+			printf("checkpoint: can't write %s\n", path);
+
+		if (ckpt_signal) {
+			printf("Interrupted, checkpoint saved in %s\n", path);
+			exit(128 + ckpt_signal);
+		}
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	unlink(path);
+
+	res = strassen_combine(ck.M, n);
+	progress_flush();
+	return res;
+}
+
+/*
+ * Asynchronous tile I/O.
+ *
+ * Keeps several reads/writes in flight for the streaming (-j) stages, so
+ * that they never block on one file at a time. The io_uring backend talks
+ * to the kernel through the raw syscalls, uses a registered buffer area
+ * (READ_FIXED/WRITE_FIXED) and is meant for files opened with O_DIRECT,
+ * so buffers, lengths and offsets are TILE_IO_ALIGN aligned. When io_uring
+ * is not available, or with --no-io-uring, a small thread pool doing
+ * pread/pwrite provides the same interface.
+ *
+ * Usage: tio_submit() up to the depth given to tio_init(), then reap
+ * completions with tio_wait().
+ */
+#define TILE_IO_ALIGN		4096
+#define TILE_IO_POOL_THREADS	4
+
+/* Binary matrix file of the largest size, rounded for O_DIRECT */
+#define TILE_IO_BUF	((sizeof(struct smat_header) + \
+			  NUM_ELEMS * NUM_ELEMS * sizeof(int32_t) + \
+			  TILE_IO_ALIGN - 1) & ~(size_t)(TILE_IO_ALIGN - 1))
+
+enum tio_op {
+	TIO_READ,
+	TIO_WRITE,
+};
+
+struct tio_req {
+	enum tio_op op;
+	int fd;
+	void *buf;
+	size_t len;
+	off_t off;
+	uint64_t tag;
+	ssize_t res;
+	struct tio_req *next;
+};
+
+struct tile_io {
+	bool uring;
+
+	/* io_uring backend */
+	int ring_fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	struct io_uring_cqe *cqes;
+	char *fixed;
+	size_t fixed_len;
+
+	/* Thread pool backend */
+	pthread_t threads[TILE_IO_POOL_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t queued, completed;
+	struct tio_req *todo, *todo_tail, *done;
+	bool stopping;
+};
+
+static bool tio_no_uring;
+
+static int tio_uring_init(struct tile_io *io, unsigned depth)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+
+	memset(&p, 0, sizeof(p));
+	io->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (io->ring_fd < 0)
+		return -1;
+
+	io->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	io->cq_ring_len = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (io->cq_ring_len > io->sq_ring_len)
+			io->sq_ring_len = io->cq_ring_len;
+		io->cq_ring_len = io->sq_ring_len;
+	}
+
+	io->sq_ring = mmap(NULL, io->sq_ring_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, io->ring_fd,
+			   IORING_OFF_SQ_RING);
+	if (io->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		io->cq_ring = io->sq_ring;
+	} else {
+		io->cq_ring = mmap(NULL, io->cq_ring_len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, io->ring_fd,
+				   IORING_OFF_CQ_RING);
+		if (io->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+
+	io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+	if (io->sqes == MAP_FAILED)
+		goto err_cq;
+
+	io->sq_tail = (unsigned *)((char *)io->sq_ring + p.sq_off.tail);
+	io->sq_mask = (unsigned *)((char *)io->sq_ring + p.sq_off.ring_mask);
+	io->sq_array = (unsigned *)((char *)io->sq_ring + p.sq_off.array);
+	io->cq_head = (unsigned *)((char *)io->cq_ring + p.cq_off.head);
+	io->cq_tail = (unsigned *)((char *)io->cq_ring + p.cq_off.tail);
+	io->cq_mask = (unsigned *)((char *)io->cq_ring + p.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe *)((char *)io->cq_ring + p.cq_off.cqes);
+
+	/* Registered buffers are optional, plain READ/WRITE work without */
+	if (io->fixed) {
+		iov.iov_base = io->fixed;
+		iov.iov_len = io->fixed_len;
+		if (syscall(__NR_io_uring_register, io->ring_fd,
+			    IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+			io->fixed = NULL;
+	}
+
+	return 0;
+
+err_cq:
+	if (io->cq_ring != io->sq_ring)
+		munmap(io->cq_ring, io->cq_ring_len);
+err_sq:
+	munmap(io->sq_ring, io->sq_ring_len);
+err_close:
+	close(io->ring_fd);
+	return -1;
+}
+
+static void *tio_pool_thread(void *arg)
+{
+	struct tile_io *io = arg;
+	struct tio_req *req;
+
+	pthread_mutex_lock(&io->lock);
+	for (;;) {
+		while (!io->todo && !io->stopping)
+			pthread_cond_wait(&io->queued, &io->lock);
+		if (!io->todo)
+			break;
+
+		req = io->todo;
+		io->todo = req->next;
+		if (!io->todo)
+			io->todo_tail = NULL;
+		pthread_mutex_unlock(&io->lock);
+
+		if (req->op == TIO_READ)
+			req->res = pread(req->fd, req->buf, req->len, req->off);
+		else
+			req->res = pwrite(req->fd, req->buf, req->len, req->off);
+		if (req->res < 0)
+			req->res = -errno;
+
+		pthread_mutex_lock(&io->lock);
+		req->next = io->done;
+		io->done = req;
+		pthread_cond_signal(&io->completed);
+	}
+	pthread_mutex_unlock(&io->lock);
+
+	return NULL;
+}
+
+/**
+ * tio_init: set up asynchronous tile I/O.
+ * @io: tile I/O context
+ * @depth: maximum number of requests in flight
+ * @fixed: buffer area all requests use, registered with io_uring, or NULL
+ * @fixed_len: size of the buffer area
+ */
+int tio_init(struct tile_io *io, unsigned depth, void *fixed, size_t fixed_len)
+{
+	int t;
+
+	memset(io, 0, sizeof(*io));
+	io->fixed = fixed;
+	io->fixed_len = fixed_len;
+
+	if (!tio_no_uring && !tio_uring_init(io, depth)) {
+		io->uring = true;
+		return 0;
+	}
+
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->queued, NULL);
+	pthread_cond_init(&io->completed, NULL);
+	for (t = 0; t < TILE_IO_POOL_THREADS; t++)
+		if (pthread_create(&io->threads[t], NULL, tio_pool_thread, io))
+			return -1;
+
+	return 0;
+}
+
+void tio_exit(struct tile_io *io)
+{
+	int t;
+
+	if (io->uring) {
+		munmap(io->sqes, io->sqes_len);
+		if (io->cq_ring != io->sq_ring)
+			munmap(io->cq_ring, io->cq_ring_len);
+		munmap(io->sq_ring, io->sq_ring_len);
+		close(io->ring_fd);
+		return;
+	}
+
+	pthread_mutex_lock(&io->lock);
+	io->stopping = true;
+	pthread_cond_broadcast(&io->queued);
+	pthread_mutex_unlock(&io->lock);
+	for (t = 0; t < TILE_IO_POOL_THREADS; t++)
+		pthread_join(io->threads[t], NULL);
+
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->queued);
+	pthread_cond_destroy(&io->completed);
+}
+
+/**
+ * tio_submit: start a read or write.
+ * @io: tile I/O context
+ * @op: TIO_READ or TIO_WRITE
+ * @fd: file
+ * @buf: buffer, inside the area given to tio_init()
+ * @len: bytes
+ * @off: file offset
+ * @tag: returned by tio_wait() with the completion
+ */
+int tio_submit(struct tile_io *io, enum tio_op op, int fd, void *buf,
+	       size_t len, off_t off, uint64_t tag)
+{
+	struct io_uring_sqe *sqe;
+	struct tio_req *req;
+	unsigned tail, idx;
+
+	if (io->uring) {
+		tail = *io->sq_tail;
+		idx = tail & *io->sq_mask;
+		sqe = &io->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+
+		if (io->fixed) {
+			sqe->opcode = op == TIO_READ ? IORING_OP_READ_FIXED :
+						       IORING_OP_WRITE_FIXED;
+			sqe->buf_index = 0;
+		} else {
+			sqe->opcode = op == TIO_READ ? IORING_OP_READ :
+						       IORING_OP_WRITE;
+		}
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = off;
+		sqe->user_data = tag;
+
+		io->sq_array[idx] = idx;
+		__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		if (syscall(__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0) < 0)
+			return -1;
+		return 0;
+	}
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return -1;
+	req->op = op;
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+	req->tag = tag;
+	req->next = NULL;
+
+	pthread_mutex_lock(&io->lock);
+	if (io->todo_tail)
+		io->todo_tail->next = req;
+	else
+		io->todo = req;
+	io->todo_tail = req;
+	pthread_cond_signal(&io->queued);
+	pthread_mutex_unlock(&io->lock);
+
+	return 0;
+}
+
+/**
+ * tio_wait: wait for one request to complete.
+ * @io: tile I/O context
+ * @tag: returns the tag of the request
+ * @res: returns bytes transferred or -errno
+ */
+int tio_wait(struct tile_io *io, uint64_t *tag, ssize_t *res)
+{
+	struct io_uring_cqe *cqe;
+	struct tio_req *req;
+	unsigned head;
+
+	if (io->uring) {
+		head = *io->cq_head;
+		while (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(__NR_io_uring_enter, io->ring_fd, 0, 1,
+				    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR)
+				return -1;
+		}
+
+		cqe = &io->cqes[head & *io->cq_mask];
+		*tag = cqe->user_data;
+		*res = cqe->res;
+		__atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	pthread_mutex_lock(&io->lock);
+	while (!io->done)
+		pthread_cond_wait(&io->completed, &io->lock);
+	req = io->done;
+	io->done = req->next;
+	pthread_mutex_unlock(&io->lock);
+
+	*tag = req->tag;
+	*res = req->res;
+	free(req);
+
+	return 0;
+}
+
+/* O_DIRECT where the filesystem supports it, buffered otherwise */
+static int tio_open(const char *path, int flags)
+{
+	int fd;
+
+	fd = open(path, flags | O_DIRECT, 0644);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(path, flags, 0644);
+
+	return fd;
+}
+
+static bool is_smat_path(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len > 5 && !strcmp(path + len - 5, ".smat");
+}
+
+/* Parse a binary matrix file read into buf */
+static int smat_parse(const void *buf, ssize_t len, int n, struct matrix *m)
+{
+	const struct smat_header *hdr = buf;
+	const int32_t *elems = (const int32_t *)(hdr + 1);
+	int r, c;
+
+	if (len != (ssize_t)(sizeof(*hdr) + (size_t)n * n * sizeof(int32_t)) ||
+	    memcmp(hdr->magic, SMAT_MAGIC, 4) || hdr->version != SMAT_VERSION ||
+	    hdr->n != (uint32_t)n || hdr->elem_size != sizeof(int32_t))
+		return -1;
+
+	m->i = m->j = 0;
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++)
+			m->m[r][c] = elems[r * n + c];
+
+	return 0;
+}
+
+/* Format m as a binary matrix file in buf, returns the file size */
+static size_t smat_format(void *buf, struct matrix *m, int n)
+{
+	struct smat_header *hdr = buf;
+	int32_t *elems = (int32_t *)(hdr + 1);
+	int r, c;
+
+	memcpy(hdr->magic, SMAT_MAGIC, 4);
+	hdr->version = SMAT_VERSION;
+	hdr->n = n;
+	hdr->elem_size = sizeof(int32_t);
+	for (r = 0; r < n; r++)
+		for (c = 0; c < n; c++)
+			elems[r * n + c] = m->m[m->i + r][m->j + c];
+
+	return sizeof(*hdr) + (size_t)n * n * sizeof(int32_t);
+}
+
+/*
+ * Pipeline mode: multiply every (A, B) pair listed in a manifest.
+ *
+ * Loading, multiplication and writing of the results run as three stages
+ * connected by bounded queues, so the disk and the CPU are busy at the same
+ * time:
+ *
+ *	reader thread -> job queue -> compute threads -> done queue -> writer
+ *
+ * Every manifest line is "<a file> <b file> <result file>", blank lines and
+ * lines starting with '#' are skipped. Files named *.smat are in the binary
+ * matrix format and are read and written through the asynchronous tile
+ * I/O, up to PIPELINE_IO_DEPTH requests in flight per stage. Other files
+ * are text.
+ *
+ * With -c the result cache is looked up by the reader once both operands
+ * are in, and hits go straight to the done queue; the writer stores new
+ * results in the cache. Compute threads never touch a file.
+ */
+#define PIPELINE_QUEUE_DEPTH	16
+#define PIPELINE_IO_DEPTH	16
+
+struct pipeline_job {
+	struct pipeline_job *next;	/* Free list */
+	char a_path[PATH_MAX];
+	char b_path[PATH_MAX];
+	char out_path[PATH_MAX];
+	struct matrix a, b, c;
+	int fds[3];		/* a, b and result files while I/O is in flight */
+	int pending;		/* Operands still loading, plus the reader's ref */
+	bool failed;
+	bool cached;		/* c came from the result cache */
+};
+
+struct job_queue {
+	struct pipeline_job *slots[PIPELINE_QUEUE_DEPTH];
+	int head, count;
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+struct pipeline {
+	const char *manifest;
+	int n;
+	struct job_queue todo;
+	struct job_queue done;
+	int computing;		/* Compute threads still running */
+	pthread_mutex_t lock;
+	int jobs, failed;
+	struct pipeline_job *slab;	/* Every job buffer, from huge_alloc() */
+	size_t slab_len;
+	struct pipeline_job *free_jobs;
+	pthread_cond_t job_freed;
+	char *iobuf;		/* TILE_IO_BUF for a, b and result of each job */
+	size_t iobuf_len;
+};
+
+static void job_queue_init(struct job_queue *q)
+{
+	q->head = q->count = 0;
+	q->closed = false;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+static void job_queue_destroy(struct job_queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+}
+
+static void job_queue_push(struct job_queue *q, struct pipeline_job *job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == PIPELINE_QUEUE_DEPTH)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->slots[(q->head + q->count) % PIPELINE_QUEUE_DEPTH] = job;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Returns NULL if the queue is empty right now */
+static struct pipeline_job *job_queue_trypop(struct job_queue *q)
+{
+	struct pipeline_job *job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count) {
+		job = q->slots[q->head];
+		q->head = (q->head + 1) % PIPELINE_QUEUE_DEPTH;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return job;
+}
+
+/* Returns NULL once the queue is closed and drained */
+static struct pipeline_job *job_queue_pop(struct job_queue *q)
+{
+	struct pipeline_job *job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->count && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->count) {
+		job = q->slots[q->head];
+		q->head = (q->head + 1) % PIPELINE_QUEUE_DEPTH;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return job;
+}
+
+static void job_queue_close(struct job_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Enough jobs for full queues, the I/O in flight in the reader and writer
+ * and one in every compute thread, so that the reader never waits for a
+ * free job when the queues have room.
+ */
+static int pipeline_slab_init(struct pipeline *pl, int nthreads)
+{
+	int njobs = 2 * PIPELINE_QUEUE_DEPTH + 2 * PIPELINE_IO_DEPTH +
+		    nthreads + 2;
+	int k;
+
+	pl->slab_len = njobs * sizeof(struct pipeline_job);
+	pl->slab = huge_alloc(pl->slab_len, false);
+	pl->iobuf_len = njobs * 3 * TILE_IO_BUF;
+	pl->iobuf = huge_alloc(pl->iobuf_len, false);
+	if (!pl->slab || !pl->iobuf)
+		return -1;
+	huge_prefault(pl->slab, pl->slab_len);
+	huge_prefault(pl->iobuf, pl->iobuf_len);
+
+	pl->free_jobs = NULL;
+	for (k = njobs - 1; k >= 0; k--) {
+		pl->slab[k].next = pl->free_jobs;
+		pl->free_jobs = &pl->slab[k];
+	}
+	pthread_cond_init(&pl->job_freed, NULL);
+
+	return 0;
+}
+
+static struct pipeline_job *pipeline_job_get(struct pipeline *pl)
+{
+	struct pipeline_job *job;
+
+	pthread_mutex_lock(&pl->lock);
+	while (!pl->free_jobs)
+		pthread_cond_wait(&pl->job_freed, &pl->lock);
+	job = pl->free_jobs;
+	pl->free_jobs = job->next;
+	pthread_mutex_unlock(&pl->lock);
+
+	memset(job, 0, sizeof(*job));
+	return job;
+}
+
+static void pipeline_job_put(struct pipeline *pl, struct pipeline_job *job)
+{
+	pthread_mutex_lock(&pl->lock);
+	job->next = pl->free_jobs;
+	pl->free_jobs = job;
+	pthread_cond_signal(&pl->job_freed);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static bool manifest_skip(const char *line)
+{
+	return line[0] == '#' || line[strspn(line, " \t\n")] == '\0';
+}
+
+/* Number of jobs in a manifest */
+static int manifest_count(const char *manifest)
+{
+	char line[3 * PATH_MAX];
+	int count = 0;
+	FILE *fp;
+
+	fp = fopen(manifest, "r");
+	if (fp == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (!manifest_skip(line))
+			count++;
+	fclose(fp);
+
+	return count;
+}
+
+static void pipeline_fail(struct pipeline *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	pl->failed++;
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static void *pipeline_job_buf(struct pipeline *pl, struct pipeline_job *job,
+			      int which)
+{
+	return pl->iobuf + ((job - pl->slab) * 3 + which) * TILE_IO_BUF;
+}
+
+static uint64_t pipeline_io_tag(struct pipeline *pl, struct pipeline_job *job,
+				int which)
+{
+	return (uint64_t)(job - pl->slab) << 2 | which;
+}
+
+/* Drop a reference to the operands, hand the job on once both are in */
+static void pipeline_read_done(struct pipeline *pl, struct pipeline_job *job)
+{
+	if (--job->pending)
+		return;
+
+	if (job->failed) {
+		progress_expect(-strassen_flops(pl->n));
+		pipeline_fail(pl);
+		pipeline_job_put(pl, job);
+		return;
+	}
+
+	/* A cache hit skips the compute stage */
+	job->cached = cache_dir &&
+		      result_cache_get(&job->a, &job->b, pl->n, "strassen",
+				       &job->c);
+	if (job->cached) {
+		progress_expect(-strassen_flops(pl->n));
+		job_queue_push(&pl->done, job);
+		return;
+	}
+
+	job_queue_push(&pl->todo, job);
+}
+
+static void pipeline_reap_read(struct pipeline *pl, struct tile_io *io,
+			       int *inflight)
+{
+	struct pipeline_job *job;
+	uint64_t tag;
+	ssize_t res;
+	int which;
+
+	if (tio_wait(io, &tag, &res)) {
+		printf("pipeline: tile I/O failed\n");
+		exit(EXIT_FAILURE);
+	}
+	(*inflight)--;
+
+	job = &pl->slab[tag >> 2];
+	which = tag & 3;
+	close(job->fds[which]);
+
+	if (smat_parse(pipeline_job_buf(pl, job, which), res, pl->n,
+		       which ? &job->b : &job->a)) {
+		printf("%s: not a %d x %d binary matrix\n",
+		       which ? job->b_path : job->a_path, pl->n, pl->n);
+		job->failed = true;
+	}
+
+	pipeline_read_done(pl, job);
+}
+
+/* Binary operands are read asynchronously, text ones right away */
+static void pipeline_load(struct pipeline *pl, struct tile_io *io,
+			  struct pipeline_job *job, int which, int *inflight)
+{
+	const char *path = which ? job->b_path : job->a_path;
+	int fd;
+
+	job->pending++;
+
+	if (!is_smat_path(path)) {
+		if (read_matrix_file(path, which ? &job->b : &job->a, pl->n, false))
+			job->failed = true;
+		pipeline_read_done(pl, job);
+		return;
+	}
+
+	fd = tio_open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("%s open error\n", path);
+		job->failed = true;
+		pipeline_read_done(pl, job);
+		return;
+	}
+
+	job->fds[which] = fd;
+	if (tio_submit(io, TIO_READ, fd, pipeline_job_buf(pl, job, which),
+		       TILE_IO_BUF, 0, pipeline_io_tag(pl, job, which))) {
+		close(fd);
+		job->failed = true;
+		pipeline_read_done(pl, job);
+		return;
+	}
+	(*inflight)++;
+}
+
+static void *pipeline_reader(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct pipeline_job *job;
+	char line[3 * PATH_MAX];
+	struct tile_io io;
+	int inflight = 0;
+	FILE *fp;
+
+	fp = fopen(pl->manifest, "r");
+	if (fp == NULL) {
+		printf("%s open error\n", pl->manifest);
+		job_queue_close(&pl->todo);
+		return NULL;
+	}
+
+	if (tio_init(&io, PIPELINE_IO_DEPTH, pl->iobuf, pl->iobuf_len)) {
+		printf("pipeline: tile I/O setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (manifest_skip(line))
+			continue;
+
+		job = pipeline_job_get(pl);
+
+		pthread_mutex_lock(&pl->lock);
+		pl->jobs++;
+		pthread_mutex_unlock(&pl->lock);
+
+		if (sscanf(line, "%4095s %4095s %4095s", job->a_path,
+			   job->b_path, job->out_path) != 3) {
+			printf("pipeline: bad manifest line: %s", line);
+			progress_expect(-strassen_flops(pl->n));
+			pipeline_fail(pl);
+			pipeline_job_put(pl, job);
+			continue;
+		}
+
+		while (inflight + 2 > PIPELINE_IO_DEPTH)
+			pipeline_reap_read(pl, &io, &inflight);
+
+		job->pending = 1;
+		pipeline_load(pl, &io, job, 0, &inflight);
+		pipeline_load(pl, &io, job, 1, &inflight);
+		pipeline_read_done(pl, job);
+	}
+
+	while (inflight)
+		pipeline_reap_read(pl, &io, &inflight);
+
+	tio_exit(&io);
+	fclose(fp);
+	job_queue_close(&pl->todo);
+	return NULL;
+}
+
+static void *pipeline_compute(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct pipeline_job *job;
+
+	while ((job = job_queue_pop(&pl->todo)) != NULL) {
+		job->c = strassen_matrix_multiply(job->a, job->b, pl->n);
+		progress_flush();
+		job_queue_push(&pl->done, job);
+	}
+
+	/* Last one out tells the writer nothing more is coming */
+	pthread_mutex_lock(&pl->lock);
+	if (--pl->computing == 0)
+		job_queue_close(&pl->done);
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static void pipeline_reap_write(struct pipeline *pl, struct tile_io *io,
+				int *inflight)
+{
+	struct pipeline_job *job;
+	size_t size;
+	uint64_t tag;
+	ssize_t res;
+
+	if (tio_wait(io, &tag, &res)) {
+		printf("pipeline: tile I/O failed\n");
+		exit(EXIT_FAILURE);
+	}
+	(*inflight)--;
+
+	job = &pl->slab[tag >> 2];
+	size = sizeof(struct smat_header) + (size_t)pl->n * pl->n * sizeof(int32_t);
+
+	/* The write was padded for O_DIRECT, cut the file to its real size */
+	if (res < (ssize_t)size || ftruncate(job->fds[2], size)) {
+		printf("%s write error\n", job->out_path);
+		pipeline_fail(pl);
+	}
+	if (close(job->fds[2]))
+		pipeline_fail(pl);
+
+	pipeline_job_put(pl, job);
+}
+
+/* Binary results are written asynchronously, text ones right away */
+static void pipeline_store(struct pipeline *pl, struct tile_io *io,
+			   struct pipeline_job *job, int *inflight)
+{
+	char *buf = pipeline_job_buf(pl, job, 2);
+	size_t size, len;
+	int fd;
+
+	if (cache_dir && !job->cached)
+		result_cache_put(&job->a, &job->b, pl->n, "strassen", &job->c);
+
+	if (!is_smat_path(job->out_path)) {
+		if (write_matrix_file(job->out_path, &job->c, pl->n))
+			pipeline_fail(pl);
+		pipeline_job_put(pl, job);
+		return;
+	}
+
+	size = smat_format(buf, &job->c, pl->n);
+	len = (size + TILE_IO_ALIGN - 1) & ~(size_t)(TILE_IO_ALIGN - 1);
+	memset(buf + size, 0, len - size);
+
+	fd = tio_open(job->out_path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0) {
+		printf("%s open error\n", job->out_path);
+		pipeline_fail(pl);
+		pipeline_job_put(pl, job);
+		return;
+	}
+
+	job->fds[2] = fd;
+	if (tio_submit(io, TIO_WRITE, fd, buf, len, 0,
+		       pipeline_io_tag(pl, job, 2))) {
+		close(fd);
+		pipeline_fail(pl);
+		pipeline_job_put(pl, job);
+		return;
+	}
+	(*inflight)++;
+}
+
+static void *pipeline_writer(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct pipeline_job *job;
+	struct tile_io io;
+	int inflight = 0;
+
+	if (tio_init(&io, PIPELINE_IO_DEPTH, pl->iobuf, pl->iobuf_len)) {
+		printf("pipeline: tile I/O setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		/* Only block on the queue when there is nothing to reap */
+		job = NULL;
+		if (inflight < PIPELINE_IO_DEPTH)
+			job = inflight ? job_queue_trypop(&pl->done) :
+					 job_queue_pop(&pl->done);
+		if (job) {
+			pipeline_store(pl, &io, job, &inflight);
+			continue;
+		}
+
+		if (!inflight)
+			break;
+		pipeline_reap_write(pl, &io, &inflight);
+	}
+
+	tio_exit(&io);
+	return NULL;
+}
+
+/**
+ * run_pipeline: multiply all the matrix pairs of a manifest.
+ * @manifest: manifest file, see above
+ * @n: number of row/column of every matrix
+ * @nthreads: number of compute threads
+ *
+ * Returns the number of jobs that failed.
+ */
+int run_pipeline(const char *manifest, int n, int nthreads)
+{
+	struct pipeline pl;
+	pthread_t reader, writer;
+	pthread_t *compute;
+	int t;
+
+	compute = calloc(nthreads, sizeof(*compute));
+	if (!compute) {
+		printf("pipeline: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pl.manifest = manifest;
+	pl.n = n;
+	pl.computing = nthreads;
+	pl.jobs = pl.failed = 0;
+	pthread_mutex_init(&pl.lock, NULL);
+	if (pipeline_slab_init(&pl, nthreads)) {
+		printf("pipeline: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	job_queue_init(&pl.todo);
+	job_queue_init(&pl.done);
+
+	progress_expect(manifest_count(manifest) * strassen_flops(n));
+
+	pthread_create(&reader, NULL, pipeline_reader, &pl);
+	for (t = 0; t < nthreads; t++)
+		pthread_create(&compute[t], NULL, pipeline_compute, &pl);
+	pthread_create(&writer, NULL, pipeline_writer, &pl);
+
+	pthread_join(reader, NULL);
+	for (t = 0; t < nthreads; t++)
+		pthread_join(compute[t], NULL);
+	pthread_join(writer, NULL);
+
+	printf("Pipeline: %d jobs, %d failed\n", pl.jobs, pl.failed);
+
+	job_queue_destroy(&pl.todo);
+	job_queue_destroy(&pl.done);
+	pthread_cond_destroy(&pl.job_freed);
+	pthread_mutex_destroy(&pl.lock);
+	huge_free(pl.slab, pl.slab_len, false);
+	huge_free(pl.iobuf, pl.iobuf_len, false);
+	free(compute);
+
+	return pl.failed;
 }
 
 void generate_random(struct matrix *m1, struct matrix *m2, int n)
@@ -457,25 +3166,54 @@ void print_help()
 	printf("\t-f: 			Read matrix A and B from files a.txt and b.txt respectively\n");
 	printf("\t-r: 			Generate matrix A and B internally using rand()\n");
 	printf("\t-n <num_row_col>:	Number of row/col\n");
+	printf("\t-j <manifest>:		Multiply every \"<a file> <b file> <result file>\" pair listed in manifest\n");
+	printf("\t-t <num_threads>:	Compute threads for -j\n");
+	printf("\t--no-io-uring:		Use a pread/pwrite thread pool for -j *.smat files instead of io_uring\n");
+	printf("\t-p <num_procs>:		Distribute the strassen products over num_procs worker processes\n");
+	printf("\t-g <num_procs>:		Classical (SUMMA) multiplication over a sqrt(num_procs) x sqrt(num_procs) process grid\n");
+	printf("\t-M <kbytes>:		Memory budget for -p, deeper recursion steps go depth first above it\n");
+	printf("\t--approx <eps>:		Approximate product within relative error eps (CountSketch)\n");
+	printf("\t--checkpoint <file>:	Checkpoint completed strassen products to file, flushed on SIGINT/SIGTERM\n");
+	printf("\t--resume:		Continue from the --checkpoint file instead of restarting\n");
+	printf("\t--hugetlb:		Allocate matrices from the hugetlb pool (MAP_HUGETLB)\n");
+	printf("\t-u <file>:		Apply row/col/element updates from file to A and B incrementally\n");
+	printf("\t-c <dir>:		Cache results in dir and reuse them for identical operands\n");
+	printf("\t-C <kbytes>:		Cache size cap, least recently used results are evicted above it\n");
 }
 
 int main(int argc, char *argv[])
 {
-	struct matrix m1, m2, m3;
+	struct matrix *m1, *m2, *m3;
 	int ret = 0;
-	int i, j, k, n;
-	int input, help, from_file = 0, random = 0;
+	int i, j, k, n = 0;
+	int input, help = 0, from_file = 0, random = 0;
+	int nprocs = 0, grid = 0, nthreads = 1;
+	char *manifest = NULL;
+	const char *algo;
+	char *updates = NULL;
+	struct incr_delta *deltas;
+	struct incr_product ip;
+	int ndeltas;
+	double approx_eps = 0, approx_err;
+	int sketch;
+	char *checkpoint = NULL;
+	bool resume = false;
+	static const struct option long_options[] = {
+		{ "approx", required_argument, NULL, 'e' },
+		{ "checkpoint", required_argument, NULL, 'k' },
+		{ "resume", no_argument, NULL, 'R' },
+		{ "hugetlb", no_argument, NULL, 'H' },
+		{ "no-io-uring", no_argument, NULL, 'U' },
+		{ NULL, 0, NULL, 0 },
+	};
 
 	if (argc < 4) {
 		print_help();
 		exit(EXIT_SUCCESS);
 	}
 
-	for (i = 0; i < NUM_ELEMS; i++)
-		for (j = 0; j < NUM_ELEMS; j++)
-			m1.m[i][j] = m2.m[i][j] = m3.m[i][j] = 0;
-
-	while((input = getopt(argc, argv, "frn:")) != -1) {
+	while((input = getopt_long(argc, argv, "frn:j:t:p:g:M:c:C:u:",
+				   long_options, NULL)) != -1) {
 		switch(input) {
 		case 'f':
 			from_file = 1;
@@ -495,6 +3233,61 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 
+			break;
+		case 'j':
+			manifest = optarg;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				printf("Number of threads must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			nprocs = atoi(optarg);
+			if (nprocs < 1) {
+				printf("Number of processes must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'g':
+			grid = atoi(optarg);
+			if (grid < 1) {
+				printf("Number of processes must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'C':
+			cache_max_bytes = (size_t)atol(optarg) * 1024;
+			break;
+		case 'e':
+			approx_eps = atof(optarg);
+			if (approx_eps <= 0) {
+				printf("Approximation error must be > 0\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'k':
+			checkpoint = optarg;
+			break;
+		case 'R':
+			resume = true;
+			break;
+		case 'U':
+			tio_no_uring = true;
+			break;
+		case 'H':
+			use_hugetlb = true;
+			break;
+		case 'u':
+			updates = optarg;
+			break;
+		case 'M':
+			caps_mem_limit = (size_t)atol(optarg) * 1024;
 			break;
 		default:
 			printf("Invalid option\n");
@@ -503,37 +3296,117 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (help || (optind < argc)) {
+	if (help || (optind < argc) || n <= 0) {
 		print_help();
 		exit(EXIT_SUCCESS);
 	}
 
+	if (resume && !checkpoint) {
+		printf("--resume needs --checkpoint <file>\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Only the single process strassen path checkpoints */
+	if (checkpoint && (nprocs || grid || approx_eps || manifest)) {
+		printf("--checkpoint can't be combined with -p, -g, -j or --approx\n");
+		exit(EXIT_FAILURE);
+	}
+
+	progress_init();
+
+	if (manifest)
+		exit(run_pipeline(manifest, n, nthreads) ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	/* Zeroed, so this is the first touch as well */
+	m1 = huge_alloc(3 * sizeof(struct matrix), false);
+	if (!m1) {
+		printf("Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	huge_prefault(m1, 3 * sizeof(struct matrix));
+	m2 = m1 + 1;
+	m3 = m1 + 2;
+
 	if (from_file) {
-		read_from_file(&m1, &m2, n);
+		read_from_file(m1, m2, n);
 	} else if(random) {
-		generate_random(&m1, &m2, n);
+		generate_random(m1, m2, n);
 	} else {
 		print_help();
 		exit(EXIT_SUCCESS);
 	}
 
-	m3 = strassen_matrix_multiply(m1, m2, n);
 
-	printf("Result with strassen algo: \n");
+	if (approx_eps) {
+		*m3 = approx_matrix_multiply(*m1, *m2, n, approx_eps, &approx_err,
+					    &sketch);
+		printf("Result with approximate multiplication (sketch %d, estimated relative error %.4f): \n",
+		       sketch, approx_err);
+	} else {
+		algo = grid ? "summa" : (nprocs ? "caps" : "strassen");
+		progress_expect(grid ? 2L * n * n * n : strassen_flops(n));
+		if (cache_dir && result_cache_get(m1, m2, n, algo, m3)) {
+			printf("Result from cache\n");
+		} else {
+			if (grid) {
+				*m3 = summa_matrix_multiply(*m1, *m2, n, grid);
+			} else if (nprocs) {
+				caps_start_workers(nprocs);
+				*m3 = caps_matrix_multiply(*m1, *m2, n);
+				caps_stop_workers();
+			} else if (checkpoint) {
+				*m3 = checkpointed_matrix_multiply(*m1, *m2, n,
+								  checkpoint, resume);
+			} else {
+				*m3 = strassen_matrix_multiply(*m1, *m2, n);
+			}
+			/* Below PROGRESS_BATCH nothing may be published yet */
+			progress_flush();
+
+			if (cache_dir)
+				result_cache_put(m1, m2, n, algo, m3);
+		}
+
+		if (grid)
+			printf("Result with SUMMA: \n");
+		else
+			printf("Result with strassen algo: \n");
+	}
 	for (i = 0; i < n; i++) {
 		for (j = 0; j < n; j++)
-			printf("%d\t", m3.m[m3.i + i][m3.j + j]);
+			printf("%d\t", m3->m[m3->i + i][m3->j + j]);
 		printf("\n");
 	}
 
+	if (updates) {
+		ndeltas = incr_read_deltas(updates, n, &deltas);
+		if (ndeltas < 0)
+			exit(EXIT_FAILURE);
+
+		incr_init(&ip, m1, m2, m3, n);
+		incr_apply(&ip, deltas, ndeltas);
+		*m1 = ip.a;
+		*m2 = ip.b;
+		*m3 = ip.c;
+		free(deltas);
+
+		printf("Result after %d incremental updates%s: \n", ndeltas,
+		       ip.full_recomputes ? " (recomputed)" : "");
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < n; j++)
+				printf("%d\t", m3->m[m3->i + i][m3->j + j]);
+			printf("\n");
+		}
+	}
+
 	printf("Result with standard multiplication: \n");
 	for (i = 0; i < n ; i++) {
 		for (j = 0; j < n ; j++) {
-			m3.m[i][j] = 0;
+			m3->m[i][j] = 0;
 			for (k = 0; k < n; k++) {
-				m3.m[i][j] += m1.m[i][k] * m2.m[k][j];
+				m3->m[i][j] += m1->m[i][k] * m2->m[k][j];
 			}
-			printf("%d\t", m3.m[i][j]);
+			printf("%d\t", m3->m[i][j]);
 		}
 		printf("\n");
 	}
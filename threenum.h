@@ -0,0 +1,20 @@
+#ifndef THREENUM_H
+#define THREENUM_H
+
+/*
+ * The record fwrite.c writes to program.bin, n2 = 5 * n1, n3 = n2 + 1 for
+ * n1 = 1, 2, ...
+ */
+struct threeNum
+{
+	int n1, n2, n3;
+};
+
+static inline void threenum_fill(struct threeNum *num, int n)
+{
+	num->n1 = n;
+	num->n2 = 5*n;
+	num->n3 = 5*n + 1;
+}
+
+#endif /* THREENUM_H */